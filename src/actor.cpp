@@ -0,0 +1,183 @@
+#include "actor.h"
+
+#include <algorithm>
+
+namespace qf {
+namespace co {
+
+ActorSystem::ActorSystem(Scheduler& sc, uint32_t partitions)
+	: m_sc(sc) {
+	if (partitions == 0) {
+		partitions = sc.ThreadNum() * 16;
+	}
+	for (uint32_t i = 0; i < partitions; i++) {
+		m_partitions.emplace_back(new Partition());
+		m_partitions.back()->owner.store(i % sc.ThreadNum(), std::memory_order_relaxed);
+	}
+}
+
+ActorSystem::~ActorSystem() {
+	for (auto& part : m_partitions) {
+		for (auto& iter : part->boxes) {
+			Node* node = iter.second->head.load(std::memory_order_relaxed);
+			while (node && node != Draining() && node != Closed()) {
+				Node* next = node->next;
+				delete node;
+				node = next;
+			}
+			delete iter.second;
+		}
+	}
+}
+
+uint32_t ActorSystem::PartitionOf(uint64_t key) const {
+	//so that neighbouring keys land apart
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdull;
+	key ^= key >> 33;
+	return (uint32_t)(key % m_partitions.size());
+}
+
+void ActorSystem::Post(uint64_t key, util::Func&& func) {
+	uint32_t p = PartitionOf(key);
+	auto& part = *m_partitions[p];
+	Node* node = new Node{ std::move(func), nullptr };
+	Mailbox* box;
+	Node* old;
+	for (;;) {
+		box = Acquire(part, key);
+		old = box->head.load(std::memory_order_relaxed);
+		while (old != Closed()) {
+			node->next = old;
+			if (box->head.compare_exchange_weak(old, node, std::memory_order_release, std::memory_order_relaxed)) {
+				break;
+			}
+		}
+		if (old != Closed()) {
+			break;
+		}
+		//emptied and closed between lookup and push, the next Acquire replaces it
+		Release(box);
+	}
+	//the first message of an idle key starts its drain, which takes over the ref
+	if (old == nullptr) {
+		ScheduleDrain(p, key, box);
+	} else {
+		Release(box);
+	}
+}
+
+ActorSystem::Mailbox* ActorSystem::Acquire(Partition& part, uint64_t key) {
+	{
+		thread::ReadLockGuard<thread::RWLock> lock(part.rw);
+		auto iter = part.boxes.find(key);
+		//the map's ref can only go under the exclusive lock, the box outlives this one
+		if (iter != part.boxes.end() && iter->second->head.load(std::memory_order_relaxed) != Closed()) {
+			iter->second->refs.fetch_add(1, std::memory_order_relaxed);
+			return iter->second;
+		}
+	}
+	thread::LockGuard<thread::RWLock> lock(part.rw);
+	auto& box = part.boxes[key];
+	if (box && box->head.load(std::memory_order_relaxed) == Closed()) {
+		Release(box);
+		box = nullptr;
+	}
+	if (!box) {
+		box = new Mailbox();
+	}
+	box->refs.fetch_add(1, std::memory_order_relaxed);
+	return box;
+}
+
+void ActorSystem::Release(Mailbox* box) {
+	if (box->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		delete box;
+	}
+}
+
+void ActorSystem::ScheduleDrain(uint32_t partition, uint64_t key, Mailbox* box) {
+	uint32_t owner = m_partitions[partition]->owner.load(std::memory_order_relaxed);
+	//the messages are queued already, their drain must not be refused
+	m_sc.ScheduleAdmitted(util::CreateFunc([this, partition, key, box]() {
+		Drain(partition, key, box);
+	}), owner);
+}
+
+void ActorSystem::Drain(uint32_t partition, uint64_t key, Mailbox* box) {
+	auto& part = *m_partitions[partition];
+	Node* batch = box->head.exchange(Draining(), std::memory_order_acquire);
+	//the stack is newest first and ends at nullptr or at the mark the previous batch left
+	Node* fifo = nullptr;
+	while (batch && batch != Draining()) {
+		Node* next = batch->next;
+		batch->next = fifo;
+		fifo = batch;
+		batch = next;
+	}
+	uint64_t n = 0;
+	while (fifo) {
+		Node* next = fifo->next;
+		fifo->func();
+		delete fifo;
+		fifo = next;
+		n++;
+		//still the only drainer while suspended, the rest of the batch waits here.
+		//back to the owner's queue, the partition stays on its worker
+		if (Scheduler::SliceExpired()) {
+			m_sc.Preempt(part.owner.load(std::memory_order_relaxed));
+		}
+	}
+	part.messages.fetch_add(n, std::memory_order_relaxed);
+
+	//nothing arrived meanwhile: producers from now on go for a new box
+	Node* expected = Draining();
+	if (box->head.compare_exchange_strong(expected, Closed(), std::memory_order_relaxed)) {
+		{
+			thread::LockGuard<thread::RWLock> lock(part.rw);
+			//unless a producer replaced it already; the drain's ref keeps the address from being reused
+			auto iter = part.boxes.find(key);
+			if (iter != part.boxes.end() && iter->second == box) {
+				part.boxes.erase(iter);
+				Release(box);
+			}
+		}
+		Release(box);
+		return;
+	}
+	//more arrived meanwhile: requeue rather than loop, so other keys of the worker get a turn
+	ScheduleDrain(partition, key, box);
+}
+
+void ActorSystem::Rebalance(uint32_t partition, uint32_t threadNo) {
+	m_partitions[partition]->owner.store(threadNo % m_sc.ThreadNum(), std::memory_order_relaxed);
+}
+
+void ActorSystem::Rebalance() {
+	std::vector<std::pair<uint64_t, uint32_t>> loads;
+	for (uint32_t i = 0; i < m_partitions.size(); i++) {
+		loads.emplace_back(m_partitions[i]->messages.exchange(0, std::memory_order_relaxed), i);
+	}
+	std::sort(loads.begin(), loads.end(), std::greater<std::pair<uint64_t, uint32_t>>());
+	std::vector<uint64_t> workers(m_sc.ThreadNum(), 0);
+	for (auto& load : loads) {
+		auto least = std::min_element(workers.begin(), workers.end());
+		*least += load.first;
+		Rebalance(load.second, (uint32_t)(least - workers.begin()));
+	}
+}
+
+size_t ActorSystem::ActiveKeys() {
+	size_t n = 0;
+	for (auto& part : m_partitions) {
+		thread::ReadLockGuard<thread::RWLock> lock(part->rw);
+		for (auto& iter : part->boxes) {
+			n += iter.second->head.load(std::memory_order_relaxed) != Closed();
+		}
+	}
+	return n;
+}
+
+}
+
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include "lock.h"
+#include "scheduler.h"
+#include "util.h"
+
+namespace qf {
+namespace co {
+
+/*
+ * keyed actors on a Scheduler: the messages sent to one key run one at a time,
+ * in the order they were sent, without locks in the handlers.
+ * keys hash to partitions, more of them than workers, and each partition is
+ * owned by one worker which drains its keys' mailboxes. Rebalance moves
+ * partitions between workers; a mailbox has a single drainer at any time, so
+ * moving never reorders. a key costs nothing while it has no messages queued
+ */
+class ActorSystem {
+public:
+	// partitions 0 picks 16 per worker
+	ActorSystem(Scheduler& sc, uint32_t partitions = 0);
+
+	~ActorSystem();
+
+	ActorSystem(const ActorSystem&) = delete;
+	ActorSystem& operator=(const ActorSystem&) = delete;
+
+	template<class F, class... ArgList>
+	void Send(uint64_t key, F&& f, ArgList&&... argList) {
+		Post(key, util::CreateFunc(std::forward<F>(f), std::forward<ArgList>(argList)...));
+	}
+
+	uint32_t PartitionNum() const {
+		return (uint32_t)m_partitions.size();
+	}
+
+	uint32_t PartitionOf(uint64_t key) const;
+
+	uint32_t Owner(uint32_t partition) const {
+		return m_partitions[partition]->owner.load(std::memory_order_relaxed);
+	}
+
+	// hands partition to worker threadNo, from its next drain on
+	void Rebalance(uint32_t partition, uint32_t threadNo);
+
+	// spreads the partitions by the messages each ran since the last call,
+	// heaviest first onto the least loaded worker
+	void Rebalance();
+
+	// keys with messages queued or running
+	size_t ActiveKeys();
+
+private:
+	struct Node {
+		util::Func func;
+		Node* next;
+	};
+
+	// the whole state of a key with messages: a lock-free MPSC stack. producers push,
+	// the drainer takes everything with one exchange, leaving the Draining() mark behind.
+	// an emptied box is marked Closed() and left for a new one; refs are held by the map,
+	// by a producer between lookup and push, and by the scheduled drain
+	struct Mailbox {
+		std::atomic<Node*> head{nullptr};
+		std::atomic<uint32_t> refs{1};
+	};
+
+	static Node* Draining() {
+		return (Node*)1;
+	}
+
+	static Node* Closed() {
+		return (Node*)2;
+	}
+
+	struct alignas(64) Partition : util::AlignedNew<Partition> {
+		thread::RWLock rw;	//guards boxes: shared to look up, exclusive to insert or erase
+		std::unordered_map<uint64_t, Mailbox*> boxes;
+		std::atomic<uint32_t> owner{0};
+		std::atomic<uint64_t> messages{0};
+	};
+
+	void Post(uint64_t key, util::Func&& func);
+
+	// the key's open box with a ref taken, made if there is none
+	Mailbox* Acquire(Partition& part, uint64_t key);
+
+	static void Release(Mailbox* box);
+
+	void ScheduleDrain(uint32_t partition, uint64_t key, Mailbox* box);
+
+	void Drain(uint32_t partition, uint64_t key, Mailbox* box);
+
+private:
+	Scheduler& m_sc;
+	std::vector<std::unique_ptr<Partition>> m_partitions;
+};
+
+}
+
+}
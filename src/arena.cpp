@@ -0,0 +1,101 @@
+#include <stdlib.h>
+
+#include "arena.h"
+#include "coroutine.h"
+
+namespace qf {
+namespace co {
+
+//chunks are plain malloc memory: a coroutine may finish on another worker than its chunks came from
+struct ChunkPool {
+	static constexpr size_t maxChunks = 256;
+
+	void* head = nullptr;
+	size_t count = 0;
+	bool closed = false;	//arenas destroyed later in thread exit free their chunks
+
+	~ChunkPool() {
+		while (head) {
+			void* next = *(void**)head;
+			free(head);
+			head = next;
+		}
+		closed = true;
+	}
+};
+
+static thread_local ChunkPool t_pool;
+
+void* Arena::AllocSlow(size_t size, size_t align) {
+	if (size + align > chunkSize / 4) {
+		char* block = (char*)malloc(sizeof(Chunk) + size + align);
+		auto chunk = (Chunk*)block;
+		chunk->next = m_large;
+		m_large = chunk;
+		uintptr_t p = ((uintptr_t)(chunk + 1) + align - 1) & ~(uintptr_t)(align - 1);
+		return (void*)p;
+	}
+	Chunk* chunk;
+	if (t_pool.head && !t_pool.closed) {
+		chunk = (Chunk*)t_pool.head;
+		t_pool.head = chunk->next;
+		t_pool.count--;
+	} else {
+		chunk = (Chunk*)malloc(chunkSize);
+	}
+	chunk->next = m_head;
+	m_head = chunk;
+	if (!m_tail) {
+		m_tail = chunk;
+	}
+	m_chunks++;
+	m_ptr = (char*)(chunk + 1);
+	m_end = (char*)chunk + chunkSize;
+	return Alloc(size, align);
+}
+
+void Arena::Reset() {
+	while (m_large) {
+		Chunk* next = m_large->next;
+		free(m_large);
+		m_large = next;
+	}
+	if (m_head) {
+		if (!t_pool.closed && t_pool.count + m_chunks <= ChunkPool::maxChunks) {
+			//the whole chain in one splice
+			m_tail->next = (Chunk*)t_pool.head;
+			t_pool.head = m_head;
+			t_pool.count += m_chunks;
+		} else {
+			while (m_head) {
+				Chunk* next = m_head->next;
+				free(m_head);
+				m_head = next;
+			}
+		}
+	}
+	m_head = nullptr;
+	m_tail = nullptr;
+	m_chunks = 0;
+	m_ptr = nullptr;
+	m_end = nullptr;
+}
+
+static thread_local Arena t_arena;
+
+void ResetThreadArena() {
+	t_arena.Reset();
+}
+
+size_t ArenaPoolSize() {
+	return t_pool.count;
+}
+
+Arena* CurrentArena() {
+	auto& co = GetManager()->GetRunning();
+	return co ? &co->arena : &t_arena;
+}
+
+}
+
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace qf {
+namespace co {
+
+/*
+ * bump allocation for one coroutine's short-lived objects. memory comes in chunks
+ * from a per-thread pool and is never freed one object at a time: the coroutine
+ * hands the whole chain back when it finishes, by splicing it onto the pool.
+ * requests over a quarter chunk get blocks of their own, freed at that point too
+ */
+class Arena {
+public:
+	static constexpr size_t chunkSize = 64 * 1024;
+
+	Arena() {
+
+	}
+
+	~Arena() {
+		Reset();
+	}
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	void* Alloc(size_t size, size_t align = alignof(max_align_t)) {
+		uintptr_t p = ((uintptr_t)m_ptr + align - 1) & ~(uintptr_t)(align - 1);
+		if (m_ptr && p + size <= (uintptr_t)m_end) {
+			m_ptr = (char*)p + size;
+			return (void*)p;
+		}
+		return AllocSlow(size, align);
+	}
+
+	// only the latest allocation gives its bytes back, such as a scratch buffer freed
+	// before anything else was allocated. a growing std::vector or string allocates
+	// its new block before freeing the old one, so those stay until Reset
+	void Free(void* p, size_t size) {
+		if ((char*)p + size == m_ptr) {
+			m_ptr = (char*)p;
+		}
+	}
+
+	// everything allocated so far is gone
+	void Reset();
+
+	size_t Chunks() const {
+		return m_chunks;
+	}
+
+private:
+	struct alignas(max_align_t) Chunk {
+		Chunk* next;
+	};
+
+	void* AllocSlow(size_t size, size_t align);
+
+private:
+	Chunk* m_head = nullptr;	//the chunk being filled
+	Chunk* m_tail = nullptr;	//the first one, where the pool continues after a splice
+	size_t m_chunks = 0;
+	char* m_ptr = nullptr;
+	char* m_end = nullptr;
+	Chunk* m_large = nullptr;
+};
+
+// the running coroutine's arena, or outside a coroutine one per thread that lasts until ResetThreadArena
+Arena* CurrentArena();
+
+void ResetThreadArena();
+
+// valid until the calling coroutine finishes
+inline void* ArenaAlloc(size_t size, size_t align = alignof(max_align_t)) {
+	return CurrentArena()->Alloc(size, align);
+}
+
+// chunks the calling thread keeps for reuse
+size_t ArenaPoolSize();
+
+// a std allocator over the arena current where it was constructed. containers using
+// it must not outlive that coroutine, and release next to nothing until it finishes:
+// reserve what a growing one will need, its outgrown blocks are not reused
+template<class T>
+class ArenaAllocator {
+public:
+	typedef T value_type;
+
+	ArenaAllocator()
+		: m_arena(CurrentArena()) {
+
+	}
+
+	template<class U>
+	ArenaAllocator(const ArenaAllocator<U>& other)
+		: m_arena(other.m_arena) {
+
+	}
+
+	T* allocate(size_t n) {
+		return (T*)m_arena->Alloc(n * sizeof(T), alignof(T));
+	}
+
+	void deallocate(T* p, size_t n) {
+		m_arena->Free(p, n * sizeof(T));
+	}
+
+	template<class U>
+	bool operator==(const ArenaAllocator<U>& other) const {
+		return m_arena == other.m_arena;
+	}
+
+	template<class U>
+	bool operator!=(const ArenaAllocator<U>& other) const {
+		return m_arena != other.m_arena;
+	}
+
+private:
+	template<class U> friend class ArenaAllocator;
+
+	Arena* m_arena;
+};
+
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>> ArenaString;
+
+template<class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+}
+
+}
@@ -1,56 +1,441 @@
 #include <assert.h>
+#include <atomic>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <vector>
+
 #include "coroutine.h"
+#include "log.h"
+#include "thread.h"
+#include "trace.h"
 
 namespace qf {
 namespace co {
 
-static inline void _comain() {
-	auto manager = util::GetInstance<CoManager>();
-	auto co = manager->GetRunning();
-	assert(co);
-	co->func();
-	co->status = CoStatus::DEAD;
-	manager->DelCo(co->id);
-}
-
-const CoroutinePtr CoManager::_create(util::Func& func) {
-	auto co = std::make_shared<Coroutine>(func, ++m_coId, this);
-	getcontext(&co->ctx);
-	co->ctx.uc_stack.ss_sp = co->stack;
-	co->ctx.uc_stack.ss_size = co->initStackSize;
-	co->ctx.uc_link = &co->octx;
-	makecontext(&co->ctx, (void(*)())_comain, 0);
+struct LocalKey {
+	void (*destroy)(void*);
+	void* (*copy)(const void*);
+};
+
+static LocalKey s_localKeys[Coroutine::maxLocals];
+static std::atomic<int> s_localKeyNum{0};
+
+//locals of code that runs outside any coroutine
+struct ThreadLocals {
+	void* slots[Coroutine::maxLocals] = {};
+
+	~ThreadLocals() {
+		int n = s_localKeyNum.load(std::memory_order_acquire);
+		for (int i = 0; i < n; i++) {
+			if (slots[i] && s_localKeys[i].destroy) {
+				s_localKeys[i].destroy(slots[i]);
+			}
+		}
+	}
+};
+
+static thread_local ThreadLocals t_locals;
+
+int CreateLocalKey(void (*destroy)(void*), void* (*copy)(const void*)) {
+	static thread::Mutex mu;
+	thread::LockGuard<thread::Mutex> lock(mu);
+	int key = s_localKeyNum.load(std::memory_order_relaxed);
+	if (key >= Coroutine::maxLocals) {
+		return -1;
+	}
+	s_localKeys[key] = LocalKey{ destroy, copy };
+	s_localKeyNum.store(key + 1, std::memory_order_release);
+	return key;
+}
+
+void** CurrentLocals() {
+	auto& co = GetManager()->GetRunning();
+	return co ? co->locals : t_locals.slots;
+}
+
+//copies of the inheritable values, destroyed if they never get installed
+class LocalSnapshot {
+public:
+	typedef std::pair<int, void*> Value;
+
+	LocalSnapshot(const Value* values, int n)
+		: m_values(values, values + n) {
+
+	}
+
+	~LocalSnapshot() {
+		Clear();
+	}
+
+	// moves the values into to, destroying the ones they replace
+	void InstallTo(void** to) {
+		for (auto& kv : m_values) {
+			Destroy(kv.first, to[kv.first]);
+			to[kv.first] = kv.second;
+		}
+		m_values.clear();
+	}
+
+	// trades the values with those in to, a second call trades them back
+	void SwapWith(void** to) {
+		for (auto& kv : m_values) {
+			std::swap(to[kv.first], kv.second);
+		}
+	}
+
+	void Clear() {
+		for (auto& kv : m_values) {
+			Destroy(kv.first, kv.second);
+		}
+		m_values.clear();
+	}
+
+private:
+	static void Destroy(int key, void* value) {
+		if (value && s_localKeys[key].destroy) {
+			s_localKeys[key].destroy(value);
+		}
+	}
+
+private:
+	std::vector<Value> m_values;
+};
+
+util::Func InheritLocals(util::Func&& func) {
+	//most callers have nothing to pass on, they get no allocation
+	LocalSnapshot::Value values[Coroutine::maxLocals];
+	int copied = 0;
+	void** from = CurrentLocals();
+	int n = s_localKeyNum.load(std::memory_order_acquire);
+	for (int i = 0; i < n; i++) {
+		if (from[i] && s_localKeys[i].copy) {
+			values[copied++] = LocalSnapshot::Value(i, s_localKeys[i].copy(from[i]));
+		}
+	}
+	if (copied == 0) {
+		return std::move(func);
+	}
+	auto snapshot = std::make_shared<LocalSnapshot>(values, copied);
+	auto wrapped = util::CreateFunc([snapshot, func]() {
+		auto& co = GetManager()->GetRunning();
+		if (co) {
+			snapshot->InstallTo(co->locals);
+			func();
+			return;
+		}
+		//inline tasks and blocking jobs run on the thread itself: the values only
+		//stay for the call, then the thread gets its own back
+		snapshot->SwapWith(t_locals.slots);
+		func();
+		snapshot->SwapWith(t_locals.slots);
+		snapshot->Clear();
+	});
+	wrapped.SetType(func.Type(), func.Address());
+	return wrapped;
+}
+
+void Coroutine::ClearLocals() {
+	int n = s_localKeyNum.load(std::memory_order_acquire);
+	for (int i = 0; i < n; i++) {
+		if (locals[i]) {
+			if (s_localKeys[i].destroy) {
+				s_localKeys[i].destroy(locals[i]);
+			}
+			locals[i] = nullptr;
+		}
+	}
+}
+
+#if defined(__x86_64__)
+static constexpr bool s_sharedStackSupported = true;
+
+static char* StackPointer(ucontext_t* ctx) {
+	return (char*)ctx->uc_mcontext.gregs[REG_RSP];
+}
+#elif defined(__aarch64__)
+static constexpr bool s_sharedStackSupported = true;
+
+static char* StackPointer(ucontext_t* ctx) {
+	return (char*)ctx->uc_mcontext.sp;
+}
+#else
+static constexpr bool s_sharedStackSupported = false;
+
+static char* StackPointer(ucontext_t* ctx) {
+	return nullptr;
+}
+#endif
+
+//below the saved stack pointer that the abi lets a function use
+static constexpr size_t s_redZone = 128;
+static constexpr size_t s_helperStackSize = 64 * 1024;
+
+static std::atomic<bool> s_stackProfile{false};
+static std::atomic<uint32_t> s_stackWarnPercent{75};
+static constexpr unsigned char s_canary = 0xa5;
+
+struct StackProfile {
+	thread::Mutex mu;
+	std::map<std::string, util::Histogram> usage;
+};
+
+static StackProfile& GetStackProfile() {
+	static StackProfile* profile = new StackProfile();
+	return *profile;
+}
+
+void EnableStackProfile(bool enable, uint32_t warnPercent) {
+	s_stackWarnPercent.store(warnPercent, std::memory_order_relaxed);
+	s_stackProfile.store(enable, std::memory_order_relaxed);
+}
+
+void SetName(const char* name) {
+	auto& co = GetManager()->GetRunning();
+	if (co) {
+		co->name = name;
+	}
+}
+
+static std::string TaskType(Coroutine* co) {
+	if (co->name) {
+		return co->name;
+	}
+	auto addr = co->func.Address();
+	if (!addr) {
+		return util::TypeName(co->func.Type());
+	}
+	//plain functions of one signature share a type: tell them apart by symbol, or by address
+	Dl_info info;
+	if (dladdr(addr, &info) && info.dli_sname && info.dli_saddr == addr) {
+		return util::Demangle(info.dli_sname);
+	}
+	char buf[32];
+	snprintf(buf, sizeof(buf), " at %p", addr);
+	return util::TypeName(co->func.Type()) + buf;
+}
+
+//the stack grows down, so the deepest frame reached is the lowest word the canary is gone from
+static void RecordStackUsage(Coroutine* co) {
+	const uint64_t canary = 0x0101010101010101ull * s_canary;
+	const uint64_t size = Coroutine::initStackSize;
+	const uint64_t* word = (const uint64_t*)co->stack;
+	const uint64_t* end = (const uint64_t*)(co->stack + size);
+	while (word < end && *word == canary) {
+		word++;
+	}
+	uint64_t used = (const char*)end - (const char*)word;
+	auto type = TaskType(co);
+	{
+		auto& profile = GetStackProfile();
+		thread::LockGuard<thread::Mutex> lock(profile.mu);
+		profile.usage[type].Record(used);
+	}
+	if (used * 100 >= size * s_stackWarnPercent.load(std::memory_order_relaxed)) {
+		GetLogger()->Warning("coroutine", co->id, type, "used", used, "of", size, "stack bytes");
+	}
+}
+
+std::map<std::string, util::Histogram> StackUsage() {
+	auto& profile = GetStackProfile();
+	thread::LockGuard<thread::Mutex> lock(profile.mu);
+	return profile.usage;
+}
+
+void ReportStackUsage(const std::string& loggerName) {
+	auto logger = GetLogger(loggerName);
+	for (auto& iter : StackUsage()) {
+		auto& h = iter.second;
+		logger->Info("stack usage(bytes)", iter.first, h.Summary());
+	}
+}
+
+static void _comain() {
+	Coroutine* self;
+	{
+		auto co = GetManager()->GetRunning();
+		assert(co);
+		co->func();
+		if (co->painted) {
+			RecordStackUsage(co.get());
+		}
+		co->ClearLocals();
+		co->arena.Reset();
+		co->status = CoStatus::DEAD;
+		QF_TRACE(CO_DEAD, co->id);
+		co->manager->DelCo(co->id);
+		self = co.get();
+	}
+	//the resumer holds the remaining reference
+	GetManager()->Finish(self);
+}
+
+const CoroutinePtr CoManager::_create(util::Func& func, StackMode mode) {
+	if (!s_sharedStackSupported) {
+		mode = StackMode::PRIVATE;
+	}
+	auto co = std::make_shared<Coroutine>(func, ++m_coId, this, mode);
+	if (mode == StackMode::SHARED) {
+		if (m_sharedStacks.empty()) {
+			for (int i = 0; i < m_sharedStackNum; i++) {
+				m_sharedStacks.push_back(std::make_shared<SharedStack>(m_sharedStackSize));
+			}
+		}
+		co->shared = m_sharedStacks[m_nextShared++ % m_sharedStacks.size()];
+		//the context is made once it gets the stack, see SwapIn
+	} else {
+		if (s_stackProfile.load(std::memory_order_relaxed)) {
+			memset(co->stack, s_canary, co->initStackSize);
+			co->painted = true;
+		}
+		getcontext(&co->ctx);
+		co->ctx.uc_stack.ss_sp = co->stack;
+		co->ctx.uc_stack.ss_size = co->initStackSize;
+		co->ctx.uc_link = &co->octx;
+		makecontext(&co->ctx, (void(*)())_comain, 0);
+	}
+	thread::LockGuard<thread::Mutex> lock(m_mu);
 	m_cos.insert(std::make_pair(co->id, co));
+	QF_TRACE(CO_CREATE, co->id);
 	return co;
 }
 
-void CoManager::Resume(CoroutinePtr& co) {
+bool CoManager::Resume(CoroutinePtr& co) {
 	assert(co->status == CoStatus::SUSPENDED);
 	co->status = CoStatus::RUNNING;
 	auto oco = SetRunning(co);
-	swapcontext(&co->octx, &co->ctx);
+	co->resumer = oco.get();
+	QF_TRACE(CO_RESUME, co->id);
+	SwitchTo(oco.get(), &co->octx, co.get(), &co->ctx);
+	QF_TRACE(CO_RESUME_END, co->id);
 	SetRunning(oco);
+	bool dead = co->status == CoStatus::DEAD;
+	if (dead && co->shared) {
+		if (co->shared->occupant == co.get()) {
+			co->shared->occupant = nullptr;
+		}
+		free(co->saved);
+		co->saved = nullptr;
+		co->savedSize = co->savedCap = 0;
+	}
+	if (m_afterYield) {
+		auto after = std::move(m_afterYield);
+		after();
+	}
+	return dead;
 }
 
 void CoManager::Yield() {
 	assert(m_running);
 	assert(m_running->status == CoStatus::RUNNING);
-	m_running->status = CoStatus::SUSPENDED;
-	swapcontext(&m_running->ctx, &m_running->octx);
+	auto co = m_running.get();
+	co->status = CoStatus::SUSPENDED;
+	QF_TRACE(CO_YIELD, co->id);
+	SwitchTo(co, &co->ctx, co->resumer, &co->octx);
+}
+
+void CoManager::Finish(Coroutine* co) {
+	SwitchTo(co, &co->ctx, co->resumer, &co->octx);
+	assert(false);
+}
+
+/*
+ * cur is the coroutine executing now (nullptr for the thread's own stack), to the one
+ * that owns toCtx. a SHARED target gets its stack copied back first; when that would
+ * overwrite the stack we are running on, the helper context does it instead
+ */
+void CoManager::SwitchTo(Coroutine* cur, ucontext_t* from, Coroutine* to, ucontext_t* toCtx) {
+	if (cur && cur->shared) {
+		cur->switchedFrom = from;
+	}
+	auto ss = to ? to->shared.get() : nullptr;
+	if (!ss || ss->occupant == to) {
+		swapcontext(from, toCtx);
+		return;
+	}
+	if (cur && cur->shared.get() == ss) {
+		if (!m_helperStack) {
+			m_helperStack = (char*)malloc(s_helperStackSize);
+			getcontext(&m_helperCtx);
+			m_helperCtx.uc_stack.ss_sp = m_helperStack;
+			m_helperCtx.uc_stack.ss_size = s_helperStackSize;
+			m_helperCtx.uc_link = nullptr;
+			makecontext(&m_helperCtx, (void(*)())SwitchMain, 0);
+		}
+		m_switchTo = to;
+		m_switchCtx = toCtx;
+		swapcontext(from, &m_helperCtx);
+		return;
+	}
+	SwapIn(to);
+	swapcontext(from, toCtx);
+}
+
+void CoManager::SwitchMain() {
+	auto manager = GetManager().get();
+	while (true) {
+		manager->SwapIn(manager->m_switchTo);
+		swapcontext(&manager->m_helperCtx, manager->m_switchCtx);
+	}
+}
+
+void CoManager::SwapIn(Coroutine* co) {
+	auto ss = co->shared.get();
+	auto occupant = ss->occupant;
+	if (occupant && occupant != co && occupant->status != CoStatus::DEAD) {
+		SaveStack(occupant);
+	}
+	ss->occupant = co;
+	if (!co->started) {
+		co->started = true;
+		getcontext(&co->ctx);
+		co->ctx.uc_stack.ss_sp = ss->base;
+		co->ctx.uc_stack.ss_size = ss->size;
+		co->ctx.uc_link = &co->octx;
+		makecontext(&co->ctx, (void(*)())_comain, 0);
+	} else if (co->savedSize) {
+		memcpy(ss->base + ss->size - co->savedSize, co->saved, co->savedSize);
+	}
+}
+
+//copies the used part of the stack out to a buffer of about the same size
+void CoManager::SaveStack(Coroutine* co) {
+	auto ss = co->shared.get();
+	char* top = ss->base + ss->size;
+	char* sp = StackPointer(co->switchedFrom) - s_redZone;
+	if (sp < ss->base) {
+		sp = ss->base;
+	}
+	size_t n = top - sp;
+	if (n > co->savedCap || n < co->savedCap / 2) {
+		free(co->saved);
+		co->saved = (char*)malloc(n);
+		co->savedCap = n;
+	}
+	memcpy(co->saved, sp, n);
+	co->savedSize = n;
+}
+
+void CoManager::YieldWith(util::Func&& after) {
+	m_afterYield = std::move(after);
+	Yield();
 }
 
 void Resume(const CoroutinePtr& co) {
-	auto manager = util::GetInstance<CoManager>();
+	auto manager = GetManager();
 	manager->Resume(const_cast<CoroutinePtr&>(co));
 }
 
 void Yield() {
-	auto manager = util::GetInstance<CoManager>();
+	auto manager = GetManager();
 	manager->Yield();
 }
 
+void YieldWith(util::Func&& after) {
+	GetManager()->YieldWith(std::move(after));
+}
+
 const CoroutinePtr Running() {
-	auto manager = util::GetInstance<CoManager>();
+	auto manager = GetManager();
 	return manager->GetRunning();
 }
 
@@ -64,7 +449,7 @@ const char* Status(const CoroutinePtr& co) {
 	return StatusDesc[co->status];
 }
 
-CoManagerPtr GetManager() {
+const CoManagerPtr& GetManager() {
 	static thread_local CoManagerPtr manager;
 	if (!manager) {
 		manager = std::make_shared<CoManager>();
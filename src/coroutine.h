@@ -1,10 +1,17 @@
 #pragma once
 
+#include <assert.h>
 #include <list>
 #include <map>
 #include <memory.h>
+#include <stdlib.h>
+#include <string>
 #include <ucontext.h>
+#include <vector>
 
+#include "arena.h"
+#include "histogram.h"
+#include "thread.h"
 #include "util.h"
 
 namespace qf {
@@ -16,25 +23,84 @@ enum class CoStatus {
 	SUSPENDED = 2,
 };
 
+enum class StackMode {
+	PRIVATE = 0,	//own stack of initStackSize
+	SHARED = 1,		//runs on a stack shared with other coroutines, copied out while switched away
+};
+
 class CoManager;
+struct Coroutine;
+struct GroupState;
+
+// only the coroutine that occupies it has its frames on the stack
+struct SharedStack {
+	SharedStack(size_t size)
+		: size(size) {
+		base = (char*)malloc(size);
+	}
+
+	~SharedStack() {
+		free(base);
+	}
+
+	char* base;
+	size_t size;
+	Coroutine* occupant = nullptr;
+};
+
+typedef std::shared_ptr<SharedStack> SharedStackPtr;
 
 struct Coroutine {
 public:
-	Coroutine(util::Func& func, int id, CoManager* manager)
+	Coroutine(util::Func& func, int id, CoManager* manager, StackMode mode = StackMode::PRIVATE)
 		: func(func)
 		, id(id)
-		, manager(manager) {
+		, manager(manager)
+		, mode(mode) {
+		if (mode == StackMode::PRIVATE) {
+			stack = (char*)malloc(initStackSize);
+		}
+	}
 
+	~Coroutine() {
+		ClearLocals();
+		if (shared && shared->occupant == this) {
+			shared->occupant = nullptr;
+		}
+		free(stack);
+		free(saved);
 	}
 
+	//runs the destructors of the coroutine-local values
+	void ClearLocals();
+
 	static constexpr int initStackSize = 16 * 1024 * 1024;
-	char stack[initStackSize];
+	static constexpr int maxLocals = 32;
+	char* stack = nullptr;
 	ucontext_t ctx;
 	ucontext_t octx;
 	util::Func func;
 	int id = -1;
 	CoManager* manager;
 	CoStatus status = CoStatus::SUSPENDED;
+	void* locals[maxLocals] = {};
+
+	StackMode mode;
+	Coroutine* resumer = nullptr;
+	//shared mode only
+	SharedStackPtr shared;
+	bool started = false;
+	ucontext_t* switchedFrom = nullptr;	//registers of the last switch away
+	char* saved = nullptr;
+	size_t savedSize = 0;
+	size_t savedCap = 0;
+	//stack profile
+	bool painted = false;
+	const char* name = nullptr;
+	//empty until ArenaAlloc, reset when func returns
+	Arena arena;
+	//the TaskGroup it runs for, set by the scheduler. its func keeps the group alive
+	GroupState* group = nullptr;
 };
 
 typedef std::shared_ptr<Coroutine> CoroutinePtr;
@@ -48,13 +114,28 @@ public:
 //		return _create(func);
 //	}
 
-	const CoroutinePtr _create(util::Func& func);
+	CoManager() {
+
+	}
 
-	void Resume(CoroutinePtr& co);
+	~CoManager() {
+		free(m_helperStack);
+	}
+
+	const CoroutinePtr _create(util::Func& func, StackMode mode = StackMode::PRIVATE);
+
+	// true when co finished. read co->status only when nothing else can resume it:
+	// once an after callback handed it on it may already run elsewhere
+	bool Resume(CoroutinePtr& co);
 
 	void Yield();
 
+	// yields, then runs after on the resumer's side once the switch is complete.
+	// this is how a coroutine hands itself to a waker without racing it
+	void YieldWith(util::Func&& after);
+
 	CoroutinePtr GetCo(int id) {
+		thread::LockGuard<thread::Mutex> lock(m_mu);
 		auto iter = m_cos.find(id);
 		if (iter != m_cos.end()) {
 			return iter->second;
@@ -62,7 +143,9 @@ public:
 		return nullptr;
 	}
 
+	//coroutines may die on another thread than the one that created them
 	void DelCo(int id) {
+		thread::LockGuard<thread::Mutex> lock(m_mu);
 		m_cos.erase(id);
 	}
 
@@ -72,34 +155,167 @@ public:
 		return oco;
 	}
 
-	CoroutinePtr GetRunning() {
+	const CoroutinePtr& GetRunning() {
 		return m_running;
 	}
 
+	// shared stacks handed out round robin to SHARED coroutines. set before creating any
+	void SetSharedStacks(int num, size_t size) {
+		m_sharedStackNum = num;
+		m_sharedStackSize = size;
+	}
+
+	// last switch of a dying coroutine, does not return
+	void Finish(Coroutine* co);
+
+private:
+	void SwitchTo(Coroutine* cur, ucontext_t* from, Coroutine* to, ucontext_t* toCtx);
+
+	void SwapIn(Coroutine* co);
+
+	void SaveStack(Coroutine* co);
+
+	static void SwitchMain();
+
 private:
 	int m_coId = 0;
+	thread::Mutex m_mu;
 	std::map<int, CoroutinePtr> m_cos;
 	CoroutinePtr m_running;
+	util::Func m_afterYield;
+
+	int m_sharedStackNum = 4;
+	size_t m_sharedStackSize = 8 * 1024 * 1024;
+	std::vector<SharedStackPtr> m_sharedStacks;
+	int m_nextShared = 0;
+	//finishes switches that have to overwrite the stack they start on
+	ucontext_t m_helperCtx;
+	char* m_helperStack = nullptr;
+	Coroutine* m_switchTo = nullptr;
+	ucontext_t* m_switchCtx = nullptr;
 };
 
 typedef std::shared_ptr<CoManager> CoManagerPtr;
 
+const CoManagerPtr& GetManager();
+
+// wraps func so that it starts with copies of the inheritable locals of the caller.
+// in a coroutine they are its own from then on; run outside of one, only for the call
+util::Func InheritLocals(util::Func&& func);
+
+// the coroutine starts with copies of the creator's inheritable locals
 template<class F, class... ArgList>
 const CoroutinePtr Create(F&& f, ArgList&&... argList) {
-	auto func = util::CreateFunc(std::forward<F>(f), std::forward<ArgList...>(argList)...);
-	auto manager = util::GetInstance<CoManager>();
+	auto func = InheritLocals(util::CreateFunc(std::forward<F>(f), std::forward<ArgList>(argList)...));
+	auto manager = GetManager();
 	return manager->_create(func);
 }
 
+// for large numbers of mostly idle coroutines with shallow stacks. a SHARED coroutine
+// must stay on the thread that created it
+template<class F, class... ArgList>
+const CoroutinePtr CreateShared(F&& f, ArgList&&... argList) {
+	auto func = InheritLocals(util::CreateFunc(std::forward<F>(f), std::forward<ArgList>(argList)...));
+	return GetManager()->_create(func, StackMode::SHARED);
+}
+
 void Resume(const CoroutinePtr& co);
 
 void Yield();
 
+void YieldWith(util::Func&& after);
+
 const CoroutinePtr Running();
 
 const char* Status(const CoroutinePtr& co);
 
-CoManagerPtr GetManager();
+/*
+ * stack profiling, off by default. private stacks created while it is on are
+ * painted with a canary, which commits all of their memory, and measured when
+ * the coroutine dies. usage is kept per task type, the type of the callable
+ * unless the task named itself with SetName. reaching warnPercent of the stack logs a warning
+ */
+void EnableStackProfile(bool enable, uint32_t warnPercent = 75);
+
+// names the running coroutine's task type for the stack profile. name must stay valid
+void SetName(const char* name);
+
+// high-water marks in bytes, per task type
+std::map<std::string, util::Histogram> StackUsage();
+
+void ReportStackUsage(const std::string& loggerName = "default");
+
+/*
+ * coroutine-local storage. a key indexes a fixed slot table inside every Coroutine,
+ * code running outside a coroutine gets a per-thread table instead.
+ * destroy runs when the coroutine dies; with copy the value is copied into
+ * coroutines created, or tasks scheduled, from the owning context.
+ * keys are meant to be created at startup; returns -1 once maxLocals are taken
+ */
+int CreateLocalKey(void (*destroy)(void*) = nullptr, void* (*copy)(const void*) = nullptr);
+
+void** CurrentLocals();
+
+inline void* GetLocal(int key) {
+	return CurrentLocals()[key];
+}
+
+// does not destroy the previous value
+inline void SetLocal(int key, void* value) {
+	CurrentLocals()[key] = value;
+}
+
+template<class T>
+class Local {
+public:
+	Local(bool inherit = true)
+		: m_key(CreateLocalKey(&Destroy, inherit ? &Copy : nullptr)) {
+		assert(m_key >= 0);
+	}
+
+	T* Get() const {
+		return (T*)GetLocal(m_key);
+	}
+
+	template<class V>
+	void Set(V&& v) {
+		auto old = Get();
+		SetLocal(m_key, new T(std::forward<V>(v)));
+		delete old;
+	}
+
+	void Reset() {
+		auto old = Get();
+		SetLocal(m_key, nullptr);
+		delete old;
+	}
+
+	// default constructs the value on first use
+	T& operator*() {
+		auto v = Get();
+		if (!v) {
+			v = new T();
+			SetLocal(m_key, v);
+		}
+		return *v;
+	}
+
+	T* operator->() {
+		return &**this;
+	}
+
+private:
+	static void Destroy(void* v) {
+		delete (T*)v;
+	}
+
+	static void* Copy(const void* v) {
+		return new T(*(const T*)v);
+	}
+
+private:
+	const int m_key;
+};
 
 }
 
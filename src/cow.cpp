@@ -0,0 +1,105 @@
+#include "cow.h"
+
+#include <utility>
+#include <vector>
+
+namespace qf {
+namespace thread {
+
+std::atomic<uint64_t> Epoch::s_epoch{1};
+thread_local Epoch::Slot* Epoch::t_slot = nullptr;
+
+//slots are never freed, a thread hands its slot back on exit for the next one
+static std::atomic<Epoch::Slot*> s_slots{nullptr};
+
+struct SlotRelease {
+	Epoch::Slot* slot = nullptr;
+
+	~SlotRelease() {
+		if (slot) {
+			slot->used.store(false, std::memory_order_release);
+		}
+	}
+};
+
+static thread_local SlotRelease t_release;
+
+//built on first use, loggers retire maps during static initialization
+struct RetiredList {
+	Mutex mu;
+	std::vector<std::pair<uint64_t, util::Func>> list;
+};
+
+static RetiredList& Retired() {
+	static RetiredList* retired = new RetiredList();
+	return *retired;
+}
+
+Epoch::Slot* Epoch::Acquire() {
+	Slot* slot = nullptr;
+	for (auto s = s_slots.load(std::memory_order_acquire); s; s = s->next) {
+		bool used = false;
+		if (!s->used.load(std::memory_order_relaxed)
+				&& s->used.compare_exchange_strong(used, true, std::memory_order_acquire)) {
+			slot = s;
+			break;
+		}
+	}
+	if (!slot) {
+		slot = new Slot();
+		slot->used.store(true, std::memory_order_relaxed);
+		slot->next = s_slots.load(std::memory_order_relaxed);
+		while (!s_slots.compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed)) {
+
+		}
+	}
+	t_slot = slot;
+	t_release.slot = slot;
+	return slot;
+}
+
+void Epoch::Retire(util::Func&& deleter) {
+	uint64_t epoch = s_epoch.fetch_add(1, std::memory_order_seq_cst);
+	auto& retired = Retired();
+	{
+		LockGuard<Mutex> lock(retired.mu);
+		retired.list.emplace_back(epoch, std::move(deleter));
+	}
+	Reclaim();
+}
+
+void Epoch::Reclaim() {
+	uint64_t oldest = UINT64_MAX;
+	for (auto s = s_slots.load(std::memory_order_acquire); s; s = s->next) {
+		uint64_t e = s->epoch.load(std::memory_order_seq_cst);
+		if (e && e < oldest) {
+			oldest = e;
+		}
+	}
+
+	auto& retired = Retired();
+	std::vector<util::Func> ready;
+	{
+		LockGuard<Mutex> lock(retired.mu);
+		auto keep = retired.list.begin();
+		for (auto iter = retired.list.begin(); iter != retired.list.end(); iter++) {
+			//a reader that entered in epoch e may hold anything retired at e or later
+			if (iter->first < oldest) {
+				ready.push_back(std::move(iter->second));
+			} else {
+				if (keep != iter) {
+					*keep = std::move(*iter);
+				}
+				keep++;
+			}
+		}
+		retired.list.erase(keep, retired.list.end());
+	}
+	for (auto& f : ready) {
+		f();
+	}
+}
+
+}
+
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+#include "thread.h"
+#include "util.h"
+
+namespace qf {
+namespace thread {
+
+/*
+ * epoch based reclamation for read-mostly data. readers publish the epoch they
+ * entered in, a per-thread slot, and never block or write shared lines;
+ * writers retire what they replaced and it is freed once every reader that
+ * could still see it has left
+ */
+class Epoch {
+public:
+	struct Slot {
+		std::atomic<uint64_t> epoch{0};	//0 while outside
+		std::atomic<bool> used{false};
+		uint32_t depth = 0;
+		Slot* next = nullptr;
+	};
+
+	static void Enter() {
+		Slot* slot = t_slot ? t_slot : Acquire();
+		if (slot->depth++ == 0) {
+			//seq_cst: the slot must be visible before the reader loads any pointer
+			slot->epoch.exchange(s_epoch.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+		}
+	}
+
+	static void Exit() {
+		Slot* slot = t_slot;
+		if (--slot->depth == 0) {
+			slot->epoch.store(0, std::memory_order_release);
+		}
+	}
+
+	// runs deleter once no reader can see the object any more. call it after the pointer to it was replaced
+	static void Retire(util::Func&& deleter);
+
+	// frees whatever retired objects no reader can see any more
+	static void Reclaim();
+
+private:
+	static Slot* Acquire();
+
+private:
+	static std::atomic<uint64_t> s_epoch;
+	static thread_local Slot* t_slot;
+};
+
+/*
+ * a copy-on-write pointer: readers take a snapshot without locking, writers
+ * copy it, change the copy and publish it. writers are serialized
+ */
+template<class T>
+class CowPtr {
+public:
+	CowPtr()
+		: m_ptr(new T()) {
+
+	}
+
+	~CowPtr() {
+		delete m_ptr.load(std::memory_order_relaxed);
+	}
+
+	CowPtr(const CowPtr&) = delete;
+	CowPtr& operator=(const CowPtr&) = delete;
+
+	// a snapshot, valid while the Reader lives. it must not outlive a coroutine's yield
+	class Reader {
+	public:
+		explicit Reader(const CowPtr& cow) {
+			Epoch::Enter();
+			m_p = cow.m_ptr.load(std::memory_order_seq_cst);
+		}
+
+		~Reader() {
+			Epoch::Exit();
+		}
+
+		Reader(const Reader&) = delete;
+		Reader& operator=(const Reader&) = delete;
+
+		const T* operator->() const {
+			return m_p;
+		}
+
+		const T& operator*() const {
+			return *m_p;
+		}
+
+	private:
+		const T* m_p;
+	};
+
+	// f(T&) changes a copy of the current value which then replaces it
+	template<class F>
+	void Update(F&& f) {
+		LockGuard<Mutex> lock(m_mu);
+		T* old = m_ptr.load(std::memory_order_relaxed);
+		T* next = new T(*old);
+		f(*next);
+		m_ptr.store(next, std::memory_order_seq_cst);
+		Epoch::Retire(util::CreateFunc([old]() {
+			delete old;
+		}));
+	}
+
+private:
+	std::atomic<T*> m_ptr;
+	Mutex m_mu;
+};
+
+}
+
+}
@@ -0,0 +1,375 @@
+#pragma once
+
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "coroutine.h"
+
+namespace qf {
+namespace co {
+
+template<class Range, class F> class MapRange;
+template<class Range, class F> class FilterRange;
+
+// Map and Filter for the ranges below: each takes the range over and stays lazy
+template<class Derived>
+class RangeOps {
+public:
+	template<class F>
+	MapRange<Derived, typename std::decay<F>::type> Map(F&& f) && {
+		return MapRange<Derived, typename std::decay<F>::type>(std::move(static_cast<Derived&>(*this)), std::forward<F>(f));
+	}
+
+	template<class F>
+	FilterRange<Derived, typename std::decay<F>::type> Filter(F&& f) && {
+		return FilterRange<Derived, typename std::decay<F>::type>(std::move(static_cast<Derived&>(*this)), std::forward<F>(f));
+	}
+};
+
+/*
+ * a value stream from a coroutine of its own. the body gets a Yielder and passes it
+ * values, by reference: the consumer sees the producer's object itself, valid
+ * until it asks for the next one, with no queue in between. the body runs only
+ * while the consumer waits for a value, on the consumer's thread, and must not
+ * suspend any other way. a range for, or Map and Filter, consume it once.
+ * dropping the generator early makes the pending and every later yield return
+ * false, so the body can return; an endless body must check it. a body that
+ * only has const objects to hand out, such as the elements of a const container,
+ * makes a Generator<const T>: its consumers get const references, still no copy
+ */
+template<class T>
+class Generator : public RangeOps<Generator<T>> {
+	struct State {
+		T* value = nullptr;
+		bool started = false;
+		bool done = false;
+		bool stopped = false;
+		CoroutinePtr co;
+	};
+
+public:
+	typedef T value_type;
+
+	class Yielder {
+	public:
+		explicit Yielder(State* state)
+			: m_state(state) {
+
+		}
+
+		// false once the consumer is gone
+		bool operator()(T& value) {
+			return Put(&value);
+		}
+
+		// the temporary lives on until the consumer moves on, so it may be moved from
+		bool operator()(T&& value) {
+			return Put(&value);
+		}
+
+	private:
+		bool Put(T* value) {
+			if (m_state->stopped) {
+				return false;
+			}
+			m_state->value = value;
+			Yield();
+			return !m_state->stopped;
+		}
+
+		State* m_state;
+	};
+
+	class iterator {
+	public:
+		typedef std::input_iterator_tag iterator_category;
+		typedef T value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef T* pointer;
+		typedef T& reference;
+
+		iterator(Generator* gen = nullptr)
+			: m_gen(gen) {
+
+		}
+
+		T& operator*() const {
+			return *m_gen->m_state->value;
+		}
+
+		T* operator->() const {
+			return m_gen->m_state->value;
+		}
+
+		iterator& operator++() {
+			m_gen->Advance();
+			return *this;
+		}
+
+		//an end iterator, or one whose generator finished
+		bool operator==(const iterator& other) const {
+			return Done() == other.Done();
+		}
+
+		bool operator!=(const iterator& other) const {
+			return !(*this == other);
+		}
+
+	private:
+		bool Done() const {
+			return !m_gen || m_gen->m_state->done;
+		}
+
+		Generator* m_gen;
+	};
+
+	template<class F>
+	explicit Generator(F&& body)
+		: m_state(new State()) {
+		auto state = m_state.get();
+		//shared_ptr because the body may be mutable and Func calls its callable as const
+		auto f = std::make_shared<typename std::decay<F>::type>(std::forward<F>(body));
+		m_state->co = Create([state, f]() {
+			Yielder yielder(state);
+			(*f)(yielder);
+			state->value = nullptr;
+			state->done = true;
+		});
+	}
+
+	Generator(Generator&& other) = default;
+
+	Generator& operator=(Generator&& other) {
+		Stop();
+		m_state = std::move(other.m_state);
+		return *this;
+	}
+
+	~Generator() {
+		Stop();
+	}
+
+	iterator begin() {
+		if (!m_state->started) {
+			Advance();
+		}
+		return iterator(this);
+	}
+
+	iterator end() {
+		return iterator();
+	}
+
+private:
+	void Advance() {
+		if (m_state->done) {
+			return;
+		}
+		m_state->started = true;
+		co::Resume(m_state->co);
+	}
+
+	void Stop() {
+		if (!m_state || m_state->done) {
+			return;
+		}
+		if (!m_state->started) {
+			//never ran: nothing on its stack to unwind
+			m_state->co->manager->DelCo(m_state->co->id);
+			return;
+		}
+		m_state->stopped = true;
+		while (!m_state->done) {
+			co::Resume(m_state->co);
+		}
+	}
+
+private:
+	std::unique_ptr<State> m_state;
+};
+
+// f applied to each value as it is read
+template<class Range, class F>
+class MapRange : public RangeOps<MapRange<Range, F>> {
+	typedef decltype(std::declval<Range&>().begin()) SourceIter;
+
+public:
+	typedef typename std::decay<decltype(std::declval<F&>()(*std::declval<SourceIter&>()))>::type value_type;
+
+	// the result is made on first access and kept until ++, so a Filter after it maps once
+	class iterator {
+	public:
+		typedef std::input_iterator_tag iterator_category;
+		typedef typename MapRange::value_type value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef value_type* pointer;
+		typedef value_type& reference;
+
+		iterator(SourceIter iter, F* f)
+			: m_iter(iter)
+			, m_f(f) {
+
+		}
+
+		iterator(const iterator& other)
+			: m_iter(other.m_iter)
+			, m_f(other.m_f) {
+
+		}
+
+		iterator& operator=(const iterator& other) {
+			Clear();
+			m_iter = other.m_iter;
+			m_f = other.m_f;
+			return *this;
+		}
+
+		~iterator() {
+			Clear();
+		}
+
+		value_type& operator*() const {
+			if (!m_cached) {
+				new (&m_value) value_type((*m_f)(*m_iter));
+				m_cached = true;
+			}
+			return *(value_type*)&m_value;
+		}
+
+		iterator& operator++() {
+			Clear();
+			++m_iter;
+			return *this;
+		}
+
+		bool operator==(const iterator& other) const {
+			return m_iter == other.m_iter;
+		}
+
+		bool operator!=(const iterator& other) const {
+			return m_iter != other.m_iter;
+		}
+
+	private:
+		void Clear() {
+			if (m_cached) {
+				((value_type*)&m_value)->~value_type();
+				m_cached = false;
+			}
+		}
+
+		SourceIter m_iter;
+		F* m_f;
+		mutable typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type m_value;
+		mutable bool m_cached = false;
+	};
+
+	MapRange(Range&& range, F&& f)
+		: m_range(std::move(range))
+		, m_f(std::move(f)) {
+
+	}
+
+	MapRange(Range&& range, const F& f)
+		: m_range(std::move(range))
+		, m_f(f) {
+
+	}
+
+	iterator begin() {
+		return iterator(m_range.begin(), &m_f);
+	}
+
+	iterator end() {
+		return iterator(m_range.end(), &m_f);
+	}
+
+private:
+	Range m_range;
+	F m_f;
+};
+
+// only the values f accepts, handed on by reference
+template<class Range, class F>
+class FilterRange : public RangeOps<FilterRange<Range, F>> {
+	typedef decltype(std::declval<Range&>().begin()) SourceIter;
+
+public:
+	typedef typename std::iterator_traits<SourceIter>::value_type value_type;
+
+	class iterator {
+	public:
+		typedef std::input_iterator_tag iterator_category;
+		typedef typename FilterRange::value_type value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef typename std::iterator_traits<SourceIter>::pointer pointer;
+		typedef typename std::iterator_traits<SourceIter>::reference reference;
+
+		iterator(SourceIter iter, SourceIter end, F* f)
+			: m_iter(iter)
+			, m_end(end)
+			, m_f(f) {
+			Skip();
+		}
+
+		reference operator*() const {
+			return *m_iter;
+		}
+
+		iterator& operator++() {
+			++m_iter;
+			Skip();
+			return *this;
+		}
+
+		bool operator==(const iterator& other) const {
+			return m_iter == other.m_iter;
+		}
+
+		bool operator!=(const iterator& other) const {
+			return m_iter != other.m_iter;
+		}
+
+	private:
+		void Skip() {
+			while (m_iter != m_end && !(*m_f)(*m_iter)) {
+				++m_iter;
+			}
+		}
+
+		SourceIter m_iter;
+		SourceIter m_end;
+		F* m_f;
+	};
+
+	FilterRange(Range&& range, F&& f)
+		: m_range(std::move(range))
+		, m_f(std::move(f)) {
+
+	}
+
+	FilterRange(Range&& range, const F& f)
+		: m_range(std::move(range))
+		, m_f(f) {
+
+	}
+
+	iterator begin() {
+		return iterator(m_range.begin(), m_range.end(), &m_f);
+	}
+
+	iterator end() {
+		return iterator(m_range.end(), m_range.end(), &m_f);
+	}
+
+private:
+	Range m_range;
+	F m_f;
+};
+
+}
+
+}
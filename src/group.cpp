@@ -0,0 +1,149 @@
+#include "group.h"
+
+#include <algorithm>
+
+namespace qf {
+namespace co {
+
+void GroupState::Finish(uint64_t n) {
+	std::vector<Waiter> wake;
+	{
+		thread::LockGuard<thread::Mutex> lock(mu);
+		pending -= n;
+		if (pending) {
+			return;
+		}
+		wake.swap(waiters);
+		cond.Broadcast();
+	}
+	for (auto& waiter : wake) {
+		waiter.sc->ScheduleCo(waiter.co);
+	}
+}
+
+TaskGroup::TaskGroup(Scheduler* sc)
+	: m_state(std::make_shared<GroupState>()) {
+	assert(sc);
+	m_state->sc = sc;
+	auto parent = Scheduler::CurrentGroup();
+	if (!parent) {
+		return;
+	}
+	//a Cancel of the parent either sees the child or set the flag before this lock
+	thread::LockGuard<thread::Mutex> lock(parent->mu);
+	if (parent->Cancelled()) {
+		m_state->cancelled.store(true, std::memory_order_release);
+		return;
+	}
+	auto& children = parent->children;
+	if (children.size() == children.capacity()) {
+		children.erase(std::remove_if(children.begin(), children.end(), [](const std::weak_ptr<GroupState>& child) {
+			return child.expired();
+		}), children.end());
+	}
+	children.push_back(m_state);
+}
+
+bool TaskGroup::Push(util::Func&& func) {
+	auto state = m_state;
+	if (state->Cancelled()) {
+		return false;
+	}
+	{
+		//counted first, so a Wait racing the task's end cannot miss it
+		thread::LockGuard<thread::Mutex> lock(state->mu);
+		state->pending++;
+		state->stats.spawned++;
+	}
+	//the coroutine holds on to it, Scheduler::CurrentGroup is a plain pointer
+	auto task = util::CreateFunc([state, func]() {
+		bool run = !state->Cancelled();
+		if (run) {
+			func();
+		}
+		{
+			thread::LockGuard<thread::Mutex> lock(state->mu);
+			(run ? state->stats.completed : state->stats.skipped)++;
+		}
+		state->Finish(1);
+	});
+	auto sc = state->sc;
+	if (!sc->ScheduleInGroup(std::move(task), state.get())) {
+		{
+			thread::LockGuard<thread::Mutex> lock(state->mu);
+			state->stats.spawned--;
+		}
+		state->Finish(1);
+		return false;
+	}
+	return true;
+}
+
+static uint64_t CancelGroup(const GroupStatePtr& state) {
+	state->cancelled.store(true, std::memory_order_release);
+	auto removed = state->sc->RemoveGroup(state.get());
+	uint64_t n = removed.size();
+	std::vector<std::weak_ptr<GroupState>> children;
+	{
+		thread::LockGuard<thread::Mutex> lock(state->mu);
+		state->stats.removed += n;
+		children.swap(state->children);
+	}
+	//their funcs hold the state, let them go before the waiters run
+	removed.clear();
+	if (n) {
+		state->Finish(n);
+	}
+	for (auto& weak : children) {
+		auto child = weak.lock();
+		if (child) {
+			n += CancelGroup(child);
+		}
+	}
+	return n;
+}
+
+uint64_t TaskGroup::Cancel() {
+	return CancelGroup(m_state);
+}
+
+void TaskGroup::Wait() {
+	auto state = m_state;
+	assert(Scheduler::CurrentGroup() != state.get());
+	{
+		thread::LockGuard<thread::Mutex> lock(state->mu);
+		if (!state->pending) {
+			return;
+		}
+	}
+	auto sc = Scheduler::Current();
+	auto self = Running();
+	//a nested coroutine is resumed by its task, not by the waiters' ScheduleCo
+	if (sc && Scheduler::InTask()) {
+		//queued as a waiter once off its stack, unless the group finished meanwhile
+		YieldWith(util::CreateFunc([state, sc, self]() {
+			{
+				thread::LockGuard<thread::Mutex> lock(state->mu);
+				if (state->pending) {
+					state->waiters.push_back(GroupState::Waiter{ sc, self });
+					return;
+				}
+			}
+			sc->ScheduleCo(self);
+		}));
+		return;
+	}
+	thread::LockGuard<thread::Mutex> lock(state->mu);
+	while (state->pending) {
+		state->cond.Wait(state->mu);
+	}
+}
+
+TaskGroupStats TaskGroup::Stats() {
+	thread::LockGuard<thread::Mutex> lock(m_state->mu);
+	return m_state->stats;
+}
+
+}
+
+}
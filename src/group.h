@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "scheduler.h"
+#include "thread.h"
+#include "util.h"
+
+namespace qf {
+namespace co {
+
+struct TaskGroupStats {
+	uint64_t spawned = 0;
+	uint64_t completed = 0;	//ran, to the end or until it saw the cancellation
+	uint64_t removed = 0;	//taken off the queues by Cancel, never started
+	uint64_t skipped = 0;	//dequeued after the cancellation, never started
+};
+
+// shared by a group's tasks; they keep it alive past the TaskGroup
+struct GroupState {
+	bool Cancelled() const {
+		return cancelled.load(std::memory_order_acquire);
+	}
+
+	// n tasks left the group; wakes the waiters once none is left
+	void Finish(uint64_t n);
+
+	struct Waiter {
+		Scheduler* sc;
+		CoroutinePtr co;
+	};
+
+	Scheduler* sc;
+	std::atomic<bool> cancelled{false};
+	thread::Mutex mu;
+	thread::CondVar cond;
+	//guarded by mu
+	uint64_t pending = 0;
+	std::vector<Waiter> waiters;
+	std::vector<std::weak_ptr<GroupState>> children;	//created by its tasks, cancelled with it
+	TaskGroupStats stats;
+};
+
+typedef std::shared_ptr<GroupState> GroupStatePtr;
+
+/*
+ * tasks for one request, sharing a cancellation token. Cancel takes the group's
+ * queued tasks off the scheduler without running them; running ones see it at
+ * their next MaybeYield, io call or CheckCancelled and should return. a group
+ * created inside one of the tasks is cancelled along with it. tasks they schedule
+ * any other way are not part of the group: Cancel leaves them alone and Wait does
+ * not wait for them. Wait waits for the tasks spawned so far, however they ended;
+ * a task of the group waiting on it would wait for itself. a task suspends while
+ * it waits; a coroutine that task resumes itself blocks its worker instead
+ */
+class TaskGroup {
+public:
+	explicit TaskGroup(Scheduler* sc = Scheduler::Current());
+
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+
+	// false when the group is cancelled or the scheduler refused the task
+	template<class F, class... ArgList>
+	bool Spawn(F&& f, ArgList&&... argList) {
+		auto func = util::CreateFunc(std::forward<F>(f), std::forward<ArgList>(argList)...);
+		return Push(std::move(func));
+	}
+
+	// from any thread, also from one of the tasks. returns the tasks removed unrun,
+	// those of the nested groups included
+	uint64_t Cancel();
+
+	bool Cancelled() const {
+		return m_state->Cancelled();
+	}
+
+	// a coroutine on a worker suspends, anything else blocks the thread
+	void Wait();
+
+	TaskGroupStats Stats();
+
+private:
+	bool Push(util::Func&& func);
+
+private:
+	GroupStatePtr m_state;
+};
+
+}
+
+}
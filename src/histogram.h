@@ -0,0 +1,192 @@
+#pragma once
+
+#include <atomic>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+
+namespace util
+{
+
+/*
+ * log-linear buckets in the spirit of HdrHistogram: every power of two is split
+ * into 8 linear sub-buckets, so a recorded value is kept within 12.5%.
+ * values below 16 get a bucket of their own.
+ */
+struct HistogramBuckets {
+	static constexpr int subBits = 3;
+	static constexpr int subCount = 1 << subBits;
+	static constexpr int count = (64 - subBits + 1) * subCount;
+
+	static int Index(uint64_t v) {
+		if (v < 2 * subCount) {
+			return (int)v;
+		}
+		int msb = 63 - __builtin_clzll(v);
+		int shift = msb - subBits;
+		return shift * subCount + (int)(v >> shift);
+	}
+
+	static uint64_t LowerBound(int idx) {
+		if (idx < 2 * subCount) {
+			return idx;
+		}
+		int shift = idx / subCount - 1;
+		return (uint64_t)(idx % subCount + subCount) << shift;
+	}
+
+	static uint64_t UpperBound(int idx) {
+		if (idx + 1 >= count) {
+			return UINT64_MAX;
+		}
+		return LowerBound(idx + 1) - 1;
+	}
+};
+
+class AtomicHistogram;
+
+class Histogram {
+public:
+	void Record(uint64_t v) {
+		m_counts[HistogramBuckets::Index(v)]++;
+		m_total++;
+		m_sum += v;
+		if (v < m_min) {
+			m_min = v;
+		}
+		if (v > m_max) {
+			m_max = v;
+		}
+	}
+
+	void Merge(const Histogram& other) {
+		for (int i = 0; i < HistogramBuckets::count; i++) {
+			m_counts[i] += other.m_counts[i];
+		}
+		m_total += other.m_total;
+		m_sum += other.m_sum;
+		if (other.m_min < m_min) {
+			m_min = other.m_min;
+		}
+		if (other.m_max > m_max) {
+			m_max = other.m_max;
+		}
+	}
+
+	void Reset() {
+		*this = Histogram();
+	}
+
+	uint64_t Count() const {
+		return m_total;
+	}
+
+	uint64_t Sum() const {
+		return m_sum;
+	}
+
+	uint64_t Min() const {
+		return m_total ? m_min : 0;
+	}
+
+	uint64_t Max() const {
+		return m_max;
+	}
+
+	uint64_t Mean() const {
+		return m_total ? m_sum / m_total : 0;
+	}
+
+	// p in [0, 100]. reports the highest value equivalent to the bucket, capped by max
+	uint64_t Percentile(double p) const {
+		if (m_total == 0) {
+			return 0;
+		}
+		uint64_t rank = (uint64_t)(p / 100.0 * m_total + 0.5);
+		if (rank == 0) {
+			rank = 1;
+		}
+		uint64_t seen = 0;
+		for (int i = 0; i < HistogramBuckets::count; i++) {
+			seen += m_counts[i];
+			if (seen >= rank) {
+				uint64_t v = HistogramBuckets::UpperBound(i);
+				return v < m_max ? v : m_max;
+			}
+		}
+		return m_max;
+	}
+
+	std::string Summary() const {
+		std::ostringstream os;
+		os << "count=" << Count() << " min=" << Min() << " mean=" << Mean()
+			<< " p50=" << Percentile(50) << " p99=" << Percentile(99)
+			<< " p999=" << Percentile(99.9) << " max=" << Max();
+		return os.str();
+	}
+
+private:
+	friend class AtomicHistogram;
+
+	uint64_t m_counts[HistogramBuckets::count] = {};
+	uint64_t m_total = 0;
+	uint64_t m_sum = 0;
+	uint64_t m_min = UINT64_MAX;
+	uint64_t m_max = 0;
+};
+
+/*
+ * single writer, many readers. Record only does relaxed load/store pairs,
+ * so the owning thread never pays for a locked instruction.
+ */
+class AtomicHistogram {
+public:
+	void Record(uint64_t v) {
+		Bump(m_counts[HistogramBuckets::Index(v)], 1);
+		Bump(m_total, 1);
+		Bump(m_sum, v);
+		if (v < m_min.load(std::memory_order_relaxed)) {
+			m_min.store(v, std::memory_order_relaxed);
+		}
+		if (v > m_max.load(std::memory_order_relaxed)) {
+			m_max.store(v, std::memory_order_relaxed);
+		}
+	}
+
+	// only while nobody records
+	void Reset() {
+		for (auto& c : m_counts) {
+			c.store(0, std::memory_order_relaxed);
+		}
+		m_total.store(0, std::memory_order_relaxed);
+		m_sum.store(0, std::memory_order_relaxed);
+		m_min.store(UINT64_MAX, std::memory_order_relaxed);
+		m_max.store(0, std::memory_order_relaxed);
+	}
+
+	void MergeTo(Histogram& out) const {
+		Histogram h;
+		for (int i = 0; i < HistogramBuckets::count; i++) {
+			h.m_counts[i] = m_counts[i].load(std::memory_order_relaxed);
+		}
+		h.m_total = m_total.load(std::memory_order_relaxed);
+		h.m_sum = m_sum.load(std::memory_order_relaxed);
+		h.m_min = m_min.load(std::memory_order_relaxed);
+		h.m_max = m_max.load(std::memory_order_relaxed);
+		out.Merge(h);
+	}
+
+private:
+	static void Bump(std::atomic<uint64_t>& c, uint64_t n) {
+		c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<uint64_t> m_counts[HistogramBuckets::count] = {};
+	std::atomic<uint64_t> m_total{0};
+	std::atomic<uint64_t> m_sum{0};
+	std::atomic<uint64_t> m_min{UINT64_MAX};
+	std::atomic<uint64_t> m_max{0};
+};
+
+}
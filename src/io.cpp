@@ -0,0 +1,335 @@
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "coroutine.h"
+#include "io.h"
+#include "scheduler.h"
+
+namespace qf {
+namespace io {
+
+static std::atomic<bool> s_enabled{true};
+
+//an operation submitted by a coroutine, lives on its stack until it is resumed
+struct PendingOp {
+	co::CoroutinePtr co;
+	co::Scheduler* sc;
+	int res;
+};
+
+static thread_local UringPtr t_ring;
+static thread_local bool t_ringTried = false;
+
+static int UringSetup(unsigned entries, struct io_uring_params* p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int UringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize) {
+	return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+Uring::~Uring() {
+	if (m_sqes) {
+		munmap(m_sqes, m_sqesSize);
+	}
+	if (m_cqRing && m_cqRing != m_sqRing) {
+		munmap(m_cqRing, m_cqRingSize);
+	}
+	if (m_sqRing) {
+		munmap(m_sqRing, m_sqRingSize);
+	}
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+}
+
+UringPtr Uring::Create(unsigned entries) {
+	if (!s_enabled.load(std::memory_order_relaxed)) {
+		return nullptr;
+	}
+	UringPtr ring(new Uring());
+	if (!ring->Init(entries)) {
+		return nullptr;
+	}
+	return ring;
+}
+
+bool Uring::Init(unsigned entries) {
+	memset(&m_params, 0, sizeof(m_params));
+	m_fd = UringSetup(entries, &m_params);
+	if (m_fd < 0) {
+		return false;
+	}
+	//offset -1 as the current file position needs 5.6
+	if (!(m_params.features & IORING_FEAT_RW_CUR_POS)) {
+		return false;
+	}
+
+	m_sqRingSize = m_params.sq_off.array + m_params.sq_entries * sizeof(unsigned);
+	m_cqRingSize = m_params.cq_off.cqes + m_params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = m_params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single && m_cqRingSize > m_sqRingSize) {
+		m_sqRingSize = m_cqRingSize;
+	}
+	m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if (m_sqRing == MAP_FAILED) {
+		m_sqRing = nullptr;
+		return false;
+	}
+	if (single) {
+		m_cqRing = m_sqRing;
+	} else {
+		m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+		if (m_cqRing == MAP_FAILED) {
+			m_cqRing = nullptr;
+			return false;
+		}
+	}
+	m_sqesSize = m_params.sq_entries * sizeof(struct io_uring_sqe);
+	m_sqes = (struct io_uring_sqe*)mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+	if (m_sqes == MAP_FAILED) {
+		m_sqes = nullptr;
+		return false;
+	}
+
+	char* sq = (char*)m_sqRing;
+	m_sqHead = (unsigned*)(sq + m_params.sq_off.head);
+	m_sqTail = (unsigned*)(sq + m_params.sq_off.tail);
+	m_sqMask = (unsigned*)(sq + m_params.sq_off.ring_mask);
+	m_sqArray = (unsigned*)(sq + m_params.sq_off.array);
+	char* cq = (char*)m_cqRing;
+	m_cqHead = (unsigned*)(cq + m_params.cq_off.head);
+	m_cqTail = (unsigned*)(cq + m_params.cq_off.tail);
+	m_cqMask = (unsigned*)(cq + m_params.cq_off.ring_mask);
+	m_cqes = (struct io_uring_cqe*)(cq + m_params.cq_off.cqes);
+	m_sqeTail = *m_sqTail;
+	return true;
+}
+
+struct io_uring_sqe* Uring::GetSqe() {
+	unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+	if (m_sqeTail - head >= m_params.sq_entries) {
+		return nullptr;
+	}
+	unsigned idx = m_sqeTail & *m_sqMask;
+	auto sqe = &m_sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	m_sqArray[idx] = idx;
+	m_sqeTail++;
+	m_toSubmit++;
+	m_inflight++;
+	return sqe;
+}
+
+int Uring::Submit(unsigned waitNr) {
+	__atomic_store_n(m_sqTail, m_sqeTail, __ATOMIC_RELEASE);
+	int ret;
+	do {
+		ret = UringEnter(m_fd, m_toSubmit, waitNr, waitNr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret > 0) {
+		m_toSubmit -= (unsigned)ret < m_toSubmit ? ret : m_toSubmit;
+	}
+	return ret;
+}
+
+void Uring::Drop(struct io_uring_sqe* sqe) {
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_NOP;
+	sqe->user_data = timeoutUserData;
+	m_inflight--;
+}
+
+void Uring::Wait(uint64_t timeoutNs) {
+	m_timeout.tv_sec = timeoutNs / 1000000000;
+	m_timeout.tv_nsec = timeoutNs % 1000000000;
+	__atomic_store_n(m_sqTail, m_sqeTail, __ATOMIC_RELEASE);
+	if (m_params.features & IORING_FEAT_EXT_ARG) {
+		struct io_uring_getevents_arg arg;
+		memset(&arg, 0, sizeof(arg));
+		arg.sigmask_sz = _NSIG / 8;
+		arg.ts = (uint64_t)&m_timeout;
+		int ret = UringEnter(m_fd, m_toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		if (ret > 0) {
+			m_toSubmit -= (unsigned)ret < m_toSubmit ? ret : m_toSubmit;
+		}
+		return;
+	}
+	//older kernels: a timeout request of our own, its completion is skipped by Reap
+	auto sqe = GetSqe();
+	if (!sqe) {
+		Submit(1);
+		return;
+	}
+	m_inflight--;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uint64_t)&m_timeout;
+	sqe->len = 1;
+	sqe->user_data = timeoutUserData;
+	Submit(1);
+}
+
+void SetUringEnabled(bool enable) {
+	s_enabled.store(enable, std::memory_order_relaxed);
+}
+
+bool UringAvailable() {
+	static bool available = Uring::Create(2) != nullptr;
+	return available && s_enabled.load(std::memory_order_relaxed);
+}
+
+//the ring of the calling worker, if the caller is its task coroutine and can be suspended
+static Uring* AsyncRing() {
+	if (!co::Scheduler::InTask()) {
+		return nullptr;
+	}
+	if (!s_enabled.load(std::memory_order_relaxed)) {
+		return nullptr;
+	}
+	if (!t_ringTried) {
+		t_ringTried = true;
+		t_ring = Uring::Create();
+	}
+	return t_ring.get();
+}
+
+//a cancelled task gets ECANCELED instead of starting anything new
+static bool Cancelled() {
+	if (!co::CheckCancelled()) {
+		return false;
+	}
+	errno = ECANCELED;
+	return true;
+}
+
+// false when the ring refused the sqe: it is dropped and the caller blocks instead
+static bool Complete(Uring* ring, struct io_uring_sqe* sqe, int& ret) {
+	PendingOp op{ co::GetManager()->GetRunning(), co::Scheduler::Current(), 0 };
+	sqe->user_data = (uint64_t)&op;
+	//busy or broken: nothing was taken, so nothing would ever resume us
+	if (ring->Submit() < 0) {
+		ring->Drop(sqe);
+		return false;
+	}
+	//the worker reaps the completion once we are switched out
+	co::Yield();
+	if (op.res < 0) {
+		errno = -op.res;
+		ret = -1;
+	} else {
+		ret = op.res;
+	}
+	return true;
+}
+
+ssize_t Read(int fd, void* buf, size_t len, off_t offset) {
+	if (Cancelled()) {
+		return -1;
+	}
+	auto ring = AsyncRing();
+	auto sqe = ring ? ring->GetSqe() : nullptr;
+	if (sqe) {
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)buf;
+		sqe->len = len;
+		sqe->off = (uint64_t)offset;
+		int ret;
+		if (Complete(ring, sqe, ret)) {
+			return ret;
+		}
+	}
+	//the blocking fallback is a preemption point too, as the ring path suspends anyway
+	co::MaybeYield();
+	return offset < 0 ? read(fd, buf, len) : pread(fd, buf, len, offset);
+}
+
+ssize_t Write(int fd, const void* buf, size_t len, off_t offset) {
+	if (Cancelled()) {
+		return -1;
+	}
+	auto ring = AsyncRing();
+	auto sqe = ring ? ring->GetSqe() : nullptr;
+	if (sqe) {
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)buf;
+		sqe->len = len;
+		sqe->off = (uint64_t)offset;
+		int ret;
+		if (Complete(ring, sqe, ret)) {
+			return ret;
+		}
+	}
+	co::MaybeYield();
+	return offset < 0 ? write(fd, buf, len) : pwrite(fd, buf, len, offset);
+}
+
+int Fsync(int fd, bool dataOnly) {
+	if (Cancelled()) {
+		return -1;
+	}
+	auto ring = AsyncRing();
+	auto sqe = ring ? ring->GetSqe() : nullptr;
+	if (sqe) {
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = fd;
+		sqe->fsync_flags = dataOnly ? IORING_FSYNC_DATASYNC : 0;
+		int ret;
+		if (Complete(ring, sqe, ret)) {
+			return ret;
+		}
+	}
+	co::MaybeYield();
+	return dataOnly ? fdatasync(fd) : fsync(fd);
+}
+
+int Accept(int fd, struct sockaddr* addr, socklen_t* addrLen, int flags) {
+	if (Cancelled()) {
+		return -1;
+	}
+	auto ring = AsyncRing();
+	auto sqe = ring ? ring->GetSqe() : nullptr;
+	if (sqe) {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)addr;
+		sqe->addr2 = (uint64_t)addrLen;
+		sqe->accept_flags = flags;
+		int ret;
+		if (Complete(ring, sqe, ret)) {
+			return ret;
+		}
+	}
+	co::MaybeYield();
+	return accept4(fd, addr, addrLen, flags);
+}
+
+unsigned WorkerInflight() {
+	return t_ring ? t_ring->Inflight() : 0;
+}
+
+void WorkerReap() {
+	if (!t_ring) {
+		return;
+	}
+	t_ring->Reap([](uint64_t userData, int res) {
+		auto op = (PendingOp*)userData;
+		op->res = res;
+		op->sc->ScheduleCo(op->co);
+	});
+}
+
+void WorkerWait(uint64_t timeoutNs) {
+	if (t_ring) {
+		t_ring->Wait(timeoutNs);
+	}
+}
+
+}
+
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <memory>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+namespace qf {
+namespace io {
+
+/*
+ * a raw io_uring instance, no liburing. owned and driven by one thread.
+ * Create returns nullptr when the kernel does not offer io_uring (or it is
+ * disabled), callers then fall back to blocking syscalls
+ */
+class Uring {
+public:
+	~Uring();
+
+	static std::shared_ptr<Uring> Create(unsigned entries = 256);
+
+	// a zeroed sqe, nullptr when the submission queue is full
+	struct io_uring_sqe* GetSqe();
+
+	// submits the prepared sqes and waits for at least waitNr completions
+	int Submit(unsigned waitNr = 0);
+
+	// turns an sqe the kernel has not taken yet into a no-op whose completion Reap skips
+	void Drop(struct io_uring_sqe* sqe);
+
+	// waits up to timeoutNs for a completion
+	void Wait(uint64_t timeoutNs);
+
+	// calls f(userData, res) for every completion available, returns their number
+	template<class F>
+	int Reap(F&& f) {
+		unsigned head = *m_cqHead;
+		unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+		int n = 0;
+		while (head != tail) {
+			auto cqe = &m_cqes[head & *m_cqMask];
+			uint64_t userData = cqe->user_data;
+			int res = cqe->res;
+			head++;
+			__atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+			if (userData != timeoutUserData) {
+				m_inflight--;
+				n++;
+				f(userData, res);
+			}
+		}
+		return n;
+	}
+
+	// submitted operations whose completion has not been reaped
+	unsigned Inflight() const {
+		return m_inflight;
+	}
+
+private:
+	static constexpr uint64_t timeoutUserData = 0;	//also marks dropped sqes
+
+	Uring() {
+
+	}
+
+	bool Init(unsigned entries);
+
+private:
+	int m_fd = -1;
+	struct io_uring_params m_params;
+	void* m_sqRing = nullptr;
+	size_t m_sqRingSize = 0;
+	void* m_cqRing = nullptr;
+	size_t m_cqRingSize = 0;
+	struct io_uring_sqe* m_sqes = nullptr;
+	size_t m_sqesSize = 0;
+
+	unsigned* m_sqHead;
+	unsigned* m_sqTail;
+	unsigned* m_sqMask;
+	unsigned* m_sqArray;
+	unsigned* m_cqHead;
+	unsigned* m_cqTail;
+	unsigned* m_cqMask;
+	struct io_uring_cqe* m_cqes;
+
+	unsigned m_sqeTail = 0;		//prepared, not yet published to the kernel
+	unsigned m_toSubmit = 0;
+	unsigned m_inflight = 0;
+	struct __kernel_timespec m_timeout;
+};
+
+typedef std::shared_ptr<Uring> UringPtr;
+
+// runtime switch for io_uring, on by default. off, every call blocks
+void SetUringEnabled(bool enable);
+
+// whether io_uring could be set up on this kernel
+bool UringAvailable();
+
+/*
+ * inside a coroutine on a Scheduler worker these suspend the coroutine until
+ * the worker's ring completes them; anywhere else they block. they return
+ * like the syscalls do: -1 with errno set on error. offset -1 is the current position.
+ * a task of a cancelled TaskGroup gets -1 with ECANCELED and nothing is started
+ */
+ssize_t Read(int fd, void* buf, size_t len, off_t offset = -1);
+
+ssize_t Write(int fd, const void* buf, size_t len, off_t offset = -1);
+
+int Fsync(int fd, bool dataOnly = false);
+
+int Accept(int fd, struct sockaddr* addr, socklen_t* addrLen, int flags = 0);
+
+// used by Scheduler::Main: operations of this worker still waiting for completion
+unsigned WorkerInflight();
+
+// reaps completions of this worker's ring and requeues their coroutines
+void WorkerReap();
+
+// blocks up to timeoutNs for a completion on this worker's ring
+void WorkerWait(uint64_t timeoutNs);
+
+}
+
+}
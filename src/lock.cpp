@@ -0,0 +1,80 @@
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "lock.h"
+
+namespace qf {
+namespace thread {
+
+void FutexWait(std::atomic<uint32_t>* addr, uint32_t val) {
+	syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAIT_PRIVATE, val, nullptr, nullptr, 0);
+}
+
+void FutexWake(std::atomic<uint32_t>* addr, int n) {
+	syscall(SYS_futex, (uint32_t*)addr, FUTEX_WAKE_PRIVATE, n, nullptr, nullptr, 0);
+}
+
+void AdaptiveMutex::LockSlow() {
+	for (int i = 0; i < spinCount; i++) {
+		uint32_t s = m_state.load(std::memory_order_relaxed);
+		if (s == 0 && m_state.compare_exchange_weak(s, 1, std::memory_order_acquire)) {
+			return;
+		}
+		CpuRelax();
+	}
+	uint32_t c = m_state.exchange(2, std::memory_order_acquire);
+	while (c != 0) {
+		FutexWait(&m_state, 2);
+		c = m_state.exchange(2, std::memory_order_acquire);
+	}
+}
+
+void RWLock::ReadLockSlow() {
+	for (int spin = 0; ; spin++) {
+		uint32_t s = m_state.load(std::memory_order_relaxed);
+		if (!(s & (writer | writerWaiting))) {
+			if (m_state.compare_exchange_weak(s, s + 1, std::memory_order_acquire)) {
+				return;
+			}
+			continue;
+		}
+		if (spin < spinCount) {
+			CpuRelax();
+		} else {
+			Wait(s);
+		}
+	}
+}
+
+void RWLock::LockSlow() {
+	for (int spin = 0; ; spin++) {
+		uint32_t s = m_state.load(std::memory_order_relaxed);
+		if (!(s & (writer | readerMask))) {
+			//drops writerWaiting, other waiting writers set it again
+			if (m_state.compare_exchange_weak(s, writer, std::memory_order_acquire)) {
+				return;
+			}
+			continue;
+		}
+		if (!(s & writerWaiting)) {
+			m_state.fetch_or(writerWaiting);
+			continue;
+		}
+		if (spin < spinCount) {
+			CpuRelax();
+		} else {
+			Wait(s);
+		}
+	}
+}
+
+void RWLock::Wait(uint32_t s) {
+	m_waiters.fetch_add(1);
+	FutexWait(&m_state, s);
+	m_waiters.fetch_sub(1);
+}
+
+}
+
+}
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <atomic>
+#include <sched.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace qf {
+namespace thread {
+
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+	_mm_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+// futex(2) on a 32 bit word, private to the process
+void FutexWait(std::atomic<uint32_t>* addr, uint32_t val);
+
+void FutexWake(std::atomic<uint32_t>* addr, int n);
+
+/*
+ * spins for a bounded number of rounds before sleeping on a futex.
+ * state: 0 unlocked, 1 locked, 2 locked with possible sleepers
+ */
+class AdaptiveMutex {
+public:
+	static constexpr int spinCount = 100;
+
+	void Lock() {
+		uint32_t c = 0;
+		if (!m_state.compare_exchange_strong(c, 1, std::memory_order_acquire)) {
+			LockSlow();
+		}
+	}
+
+	bool TryLock() {
+		uint32_t c = 0;
+		return m_state.compare_exchange_strong(c, 1, std::memory_order_acquire);
+	}
+
+	void Unlock() {
+		if (m_state.exchange(0, std::memory_order_release) == 2) {
+			FutexWake(&m_state, 1);
+		}
+	}
+
+private:
+	void LockSlow();
+
+private:
+	std::atomic<uint32_t> m_state{0};
+};
+
+/*
+ * reader-writer lock for read-mostly data. a waiting writer stops new readers,
+ * readers only touch one word and never enter the kernel while no writer is around
+ */
+class RWLock {
+public:
+	static constexpr int spinCount = 100;
+
+	void ReadLock() {
+		uint32_t s = m_state.load(std::memory_order_relaxed);
+		if ((s & (writer | writerWaiting)) || !m_state.compare_exchange_weak(s, s + 1, std::memory_order_acquire)) {
+			ReadLockSlow();
+		}
+	}
+
+	bool TryReadLock() {
+		uint32_t s = m_state.load(std::memory_order_relaxed);
+		while (!(s & (writer | writerWaiting))) {
+			if (m_state.compare_exchange_weak(s, s + 1, std::memory_order_acquire)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void ReadUnlock() {
+		uint32_t s = m_state.fetch_sub(1);
+		if ((s & readerMask) == 1 && (s & writerWaiting)) {
+			WakeAll();
+		}
+	}
+
+	void Lock() {
+		uint32_t s = 0;
+		if (!m_state.compare_exchange_strong(s, writer, std::memory_order_acquire)) {
+			LockSlow();
+		}
+	}
+
+	bool TryLock() {
+		uint32_t s = m_state.load(std::memory_order_relaxed);
+		while (!(s & (writer | readerMask))) {
+			if (m_state.compare_exchange_weak(s, writer, std::memory_order_acquire)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void Unlock() {
+		m_state.fetch_and(~writer);
+		WakeAll();
+	}
+
+private:
+	static constexpr uint32_t writer = 1u << 31;
+	static constexpr uint32_t writerWaiting = 1u << 30;
+	static constexpr uint32_t readerMask = writerWaiting - 1;
+
+	void ReadLockSlow();
+
+	void LockSlow();
+
+	void Wait(uint32_t s);
+
+	void WakeAll() {
+		if (m_waiters.load() > 0) {
+			FutexWake(&m_state, INT32_MAX);
+		}
+	}
+
+private:
+	std::atomic<uint32_t> m_state{0};
+	std::atomic<uint32_t> m_waiters{0};
+};
+
+// fifo spinlock for critical sections of a few instructions
+class TicketLock {
+public:
+	static constexpr int spinCount = 100;
+
+	void Lock() {
+		uint32_t ticket = m_next.fetch_add(1, std::memory_order_relaxed);
+		for (int spin = 0; m_serving.load(std::memory_order_acquire) != ticket; spin++) {
+			//the holder or the next in line may not be on a cpu at all
+			if (spin < spinCount) {
+				CpuRelax();
+			} else {
+				sched_yield();
+			}
+		}
+	}
+
+	bool TryLock() {
+		uint32_t serving = m_serving.load(std::memory_order_relaxed);
+		uint32_t next = serving;
+		return m_next.compare_exchange_strong(next, serving + 1, std::memory_order_acquire);
+	}
+
+	void Unlock() {
+		m_serving.store(m_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+private:
+	std::atomic<uint32_t> m_next{0};
+	std::atomic<uint32_t> m_serving{0};
+};
+
+struct DeferLock {};
+struct TryToLock {};
+
+template<class Mu>
+class UniqueLock {
+public:
+	UniqueLock(Mu& mu)
+		: m_mu(&mu) {
+		Lock();
+	}
+
+	UniqueLock(Mu& mu, TryToLock)
+		: m_mu(&mu) {
+		TryLock();
+	}
+
+	UniqueLock(Mu& mu, DeferLock)
+		: m_mu(&mu) {
+
+	}
+
+	UniqueLock(UniqueLock&& other)
+		: m_mu(other.m_mu)
+		, m_owns(other.m_owns) {
+		other.m_mu = nullptr;
+		other.m_owns = false;
+	}
+
+	UniqueLock(const UniqueLock&) = delete;
+	UniqueLock& operator=(const UniqueLock&) = delete;
+
+	~UniqueLock() {
+		if (m_owns) {
+			m_mu->Unlock();
+		}
+	}
+
+	void Lock() {
+		m_mu->Lock();
+		m_owns = true;
+	}
+
+	bool TryLock() {
+		m_owns = m_mu->TryLock();
+		return m_owns;
+	}
+
+	void Unlock() {
+		m_mu->Unlock();
+		m_owns = false;
+	}
+
+	// gives up ownership without unlocking
+	Mu* Release() {
+		auto mu = m_mu;
+		m_mu = nullptr;
+		m_owns = false;
+		return mu;
+	}
+
+	bool OwnsLock() const {
+		return m_owns;
+	}
+
+	explicit operator bool() const {
+		return m_owns;
+	}
+
+private:
+	Mu* m_mu;
+	bool m_owns = false;
+};
+
+template<class RW>
+class ReadLockGuard {
+public:
+	ReadLockGuard(RW& rw)
+		: rw(rw) {
+		rw.ReadLock();
+	}
+
+	~ReadLockGuard() {
+		rw.ReadUnlock();
+	}
+
+private:
+	RW& rw;
+};
+
+}
+
+}
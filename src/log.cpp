@@ -1,5 +1,12 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "io.h"
 #include "util.h"
 #include "log.h"
+#include "ratelimit.h"
 
 namespace qf
 {
@@ -76,15 +83,224 @@ void StdWriter::Output(LogEventPtr event) {
 	std::cout << logString << std::endl;
 }
 
+FileWriter::FileWriter(const LogFormaterPtr formater, const std::string& name, uint32_t batchLines)
+	: LogWriter(formater)
+	, m_fileName(name)
+	, m_batchLines(batchLines ? batchLines : 1) {
+	if (name.find_last_of(".log") == std::string::npos) {
+		m_fileName += ".log";
+	}
+	m_fd = open(m_fileName.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	m_batch.reserve(m_batchLines);
+	if (m_batchLines > 1) {
+		m_ring = io::Uring::Create(m_batchLines < 256 ? m_batchLines : 256);
+	}
+}
+
+FileWriter::~FileWriter() {
+	Flush();
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+}
+
 void FileWriter::Output(LogEventPtr event) {
 	auto logString = m_formater->GenLogString(event);
-	m_ofs << logString << std::endl;
+	logString.push_back('\n');
+	thread::LockGuard<thread::Mutex> lock(m_mu);
+	m_batch.push_back(std::move(logString));
+	if (m_batch.size() >= m_batchLines) {
+		WriteBatch();
+	}
+}
+
+void FileWriter::Flush() {
+	thread::LockGuard<thread::Mutex> lock(m_mu);
+	WriteBatch();
+}
+
+static void WriteAll(int fd, const char* buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+void FileWriter::WriteBatch() {
+	if (m_fd < 0 || m_batch.empty()) {
+		m_batch.clear();
+		return;
+	}
+	size_t i = 0;
+	if (m_ring) {
+		//one chain of linked writes per ring-full, appended in order by the kernel
+		while (i < m_batch.size()) {
+			struct io_uring_sqe* sqes[256];
+			unsigned n = 0;
+			while (i + n < m_batch.size() && n < 256) {
+				auto sqe = m_ring->GetSqe();
+				if (!sqe) {
+					break;
+				}
+				if (n > 0) {
+					sqes[n - 1]->flags |= IOSQE_IO_LINK;
+				}
+				auto& line = m_batch[i + n];
+				sqe->opcode = IORING_OP_WRITE;
+				sqe->fd = m_fd;
+				sqe->addr = (uint64_t)line.data();
+				sqe->len = line.size();
+				sqe->off = (uint64_t)-1;
+				sqe->user_data = i + n + 1;
+				sqes[n++] = sqe;
+			}
+			int ret = m_ring->Submit(n);
+			unsigned taken = ret > 0 ? ret : 0;
+			//the ones the kernel refused never run
+			for (unsigned k = taken; k < n; k++) {
+				m_ring->Drop(sqes[k]);
+			}
+			while (m_ring->Inflight()) {
+				//a short write breaks the chain, the rest come back canceled and go out here
+				m_ring->Reap([this](uint64_t userData, int res) {
+					auto& line = m_batch[userData - 1];
+					size_t done = res > 0 ? res : 0;
+					if (done < line.size()) {
+						WriteAll(m_fd, line.data() + done, line.size() - done);
+					}
+				});
+				//the lines must outlive the writes taken, their completions show up without a working enter
+				if (m_ring->Inflight() && m_ring->Submit(1) < 0) {
+					usleep(100);
+				}
+			}
+			i += taken;
+			if (taken < n || n == 0) {
+				//the rest of the batch, and all later ones, go out with plain writes
+				m_ring.reset();
+				break;
+			}
+		}
+	}
+	while (i < m_batch.size()) {
+		struct iovec iov[64];
+		int cnt = 0;
+		size_t total = 0;
+		for (; i < m_batch.size() && cnt < 64; i++, cnt++) {
+			iov[cnt].iov_base = (void*)m_batch[i].data();
+			iov[cnt].iov_len = m_batch[i].size();
+			total += m_batch[i].size();
+		}
+		ssize_t n = writev(m_fd, iov, cnt);
+		size_t done = n > 0 ? n : 0;
+		if (done < total) {
+			//finish a short write line by line
+			for (int k = 0; k < cnt; k++) {
+				if (done >= iov[k].iov_len) {
+					done -= iov[k].iov_len;
+					continue;
+				}
+				WriteAll(m_fd, (const char*)iov[k].iov_base + done, iov[k].iov_len - done);
+				done = 0;
+			}
+		}
+	}
+	m_batch.clear();
+}
+
+static std::atomic<RateLimitSite*> s_sites{nullptr};
+
+RateLimitSite::RateLimitSite(const char* file, int line, uint32_t perSec, uint32_t burst)
+	: m_file(file)
+	, m_line(line) {
+	perSec = perSec ? perSec : 1;
+	burst = burst ? burst : perSec;
+	m_interval = 1000000000ull / perSec;
+	m_tolerance = (burst - 1) * m_interval;
+	m_next = s_sites.load(std::memory_order_relaxed);
+	while (!s_sites.compare_exchange_weak(m_next, this, std::memory_order_release, std::memory_order_relaxed)) {
+
+	}
+}
+
+uint64_t RateLimitSite::TakeSuppressed() {
+	thread::LockGuard<thread::Mutex> lock(m_mu);
+	uint64_t n = 0;
+	for (auto counter = m_counters; counter; counter = counter->next) {
+		uint64_t dropped = counter->dropped.load(std::memory_order_relaxed);
+		n += dropped - counter->reported;
+		counter->reported = dropped;
+	}
+	return n;
+}
+
+//the counters a thread took, handed back to their sites when it exits
+struct ThreadCounters {
+	std::vector<std::pair<RateLimitSite*, RateLimitSite::Counter*>> held;
+
+	~ThreadCounters() {
+		t_exited = true;
+		for (auto& iter : held) {
+			iter.first->Release(iter.second);
+		}
+	}
+
+	static thread_local bool t_exited;
+};
+
+thread_local bool ThreadCounters::t_exited = false;
+static thread_local ThreadCounters t_counters;
+
+RateLimitSite::Counter* RateLimitSite::Acquire() {
+	Counter* counter = nullptr;
+	{
+		thread::LockGuard<thread::Mutex> lock(m_mu);
+		for (auto iter = m_counters; iter; iter = iter->next) {
+			//the count it holds is still to be reported, the new thread adds to it
+			if (iter->free) {
+				iter->free = false;
+				counter = iter;
+				break;
+			}
+		}
+		if (!counter) {
+			counter = new Counter();
+			counter->next = m_counters;
+			m_counters = counter;
+		}
+	}
+	//taken by a destructor running after t_counters': kept for good, its drops still get reported
+	if (!ThreadCounters::t_exited) {
+		t_counters.held.emplace_back(this, counter);
+	}
+	return counter;
+}
+
+void RateLimitSite::Release(Counter* counter) {
+	thread::LockGuard<thread::Mutex> lock(m_mu);
+	counter->free = true;
+}
+
+void ReportSuppressed(const LoggerPtr& logger, LogLevel level) {
+	for (auto site = s_sites.load(std::memory_order_acquire); site; site = site->Next()) {
+		uint64_t n = site->TakeSuppressed();
+		if (n) {
+			logger->Log(level, std::string(site->File()) + ":" + std::to_string(site->Line()), Suppressed{ n });
+		}
+	}
 }
 
 }
 
 const log::LoggerPtr GetLogger(const std::string& name) {
-	auto mgr = util::GetInstance<log::LoggerManager>();
+	static auto mgr = util::GetInstance<log::LoggerManager>();
 	return mgr->GetLogger(name);
 }
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
@@ -10,13 +11,20 @@
 #include <sys/time.h>
 #include <time.h>
 #include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#include "cow.h"
 #include "thread.h"
 #include "util.h"
 
 namespace qf
 {
+namespace io
+{
+class Uring;
+}
+
 namespace log
 {
 
@@ -59,8 +67,10 @@ public:
 	virtual void Format(std::ostringstream& os, const LogEventPtr event) const override {
 		struct timeval tv;
 		gettimeofday(&tv, nullptr);
+		struct tm tm;
+		localtime_r(&tv.tv_sec, &tm);
 		char buf[256];
-		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&tv.tv_sec));
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
 		int milli = tv.tv_usec / 1000;
 		os << buf << "." << std::setfill('0') << std::setw(3) << milli;
 	}
@@ -147,13 +157,21 @@ public:
 	}
 
 	void Log(LogEventPtr event) {
-		if (event->level >= m_level) {
+		if (event->level >= m_level.load(std::memory_order_relaxed)) {
 			Output(event);
 		}
 	}
 
 	void SetLogLevel(LogLevel level) {
-		m_level = level;
+		m_level.store(level, std::memory_order_relaxed);
+	}
+
+	LogLevel GetLogLevel() const {
+		return m_level.load(std::memory_order_relaxed);
+	}
+
+	virtual void Flush() {
+
 	}
 
 protected:
@@ -162,7 +180,7 @@ protected:
 	}
 
 protected:
-	LogLevel m_level = LogLevel::INFO;
+	std::atomic<LogLevel> m_level{LogLevel::INFO};
 	LogFormaterPtr m_formater;
 };
 typedef std::shared_ptr<LogWriter> LogWriterPtr;
@@ -181,34 +199,42 @@ public:
 class FileWriter : public LogWriter
 {
 public:
-	FileWriter(const LogFormaterPtr formater, const std::string& name)
-		: LogWriter(formater)
-		, m_fileName(name) {
-		if (name.find_last_of(".log") == std::string::npos) {
-			m_fileName += ".log";
-		}
-		m_ofs.open(m_fileName, std::ios::out | std::ios::app);
-	}
+	// with batchLines > 1 lines are buffered and written together,
+	// as linked io_uring writes when the kernel has it, writev otherwise
+	FileWriter(const LogFormaterPtr formater, const std::string& name, uint32_t batchLines = 1);
 
-	~FileWriter() {
-		if (m_ofs.is_open()) {
-			m_ofs.close();
-		}
-	}
+	~FileWriter();
 
 	virtual void Output(LogEventPtr event) override;
 
+	virtual void Flush() override;
+
+private:
+	void WriteBatch();
+
 private:
 	std::string m_fileName;
-	std::ofstream m_ofs;
+	int m_fd = -1;
+	uint32_t m_batchLines;
+	thread::Mutex m_mu;
+	std::vector<std::string> m_batch;
+	std::shared_ptr<io::Uring> m_ring;
 };
 
+/*
+ * writers live in a copy-on-write map: logging reads a snapshot without locking,
+ * SetLogLevel and AddFileWriter may run concurrently with it from any thread
+ */
 class Logger
 {
 public:
+	typedef std::map<std::string, LogWriterPtr> WriterMap;
+
 	Logger() {
 		LogWriterPtr writer = std::make_shared<StdWriter>(m_formater);
-		m_writers.insert(std::make_pair("default", writer));
+		m_writers.Update([&writer](WriterMap& writers) {
+			writers.insert(std::make_pair("default", writer));
+		});
 	}
 
 	template<class... Args>
@@ -237,21 +263,48 @@ public:
 	}
 
 	void SetLogLevel(LogLevel level, const std::string& name = "") {
-		if (name == "") {
-			for (auto& iter : m_writers) {
-				iter.second->SetLogLevel(level);
-			}
-		} else {
-			auto iter = m_writers.find(name);
-			if (iter != m_writers.end()) {
-				iter->second->SetLogLevel(level);
+		thread::LockGuard<thread::Mutex> lock(m_configMu);
+		{
+			thread::CowPtr<WriterMap>::Reader writers(m_writers);
+			if (name == "") {
+				for (auto& iter : *writers) {
+					iter.second->SetLogLevel(level);
+				}
+			} else {
+				auto iter = writers->find(name);
+				if (iter != writers->end()) {
+					iter->second->SetLogLevel(level);
+				}
 			}
 		}
+		UpdateMinLevel();
+	}
+
+	// whether any writer takes level, checked before a message is formatted
+	bool Enabled(LogLevel level) const {
+		return (int)level >= m_minLevel.load(std::memory_order_relaxed);
 	}
 
-	void AddFileWriter(const std::string& name) {
-		LogWriterPtr writer = std::make_shared<FileWriter>(m_formater, name);
-		m_writers.insert(std::make_pair(name, writer));
+	void AddFileWriter(const std::string& name, uint32_t batchLines = 1) {
+		AddWriter(name, std::make_shared<FileWriter>(m_formater, name, batchLines));
+	}
+
+	// compressed framed segments, see SegmentWriter in segment.h. name is the file name
+	void AddSegmentWriter(const std::string& name, const std::string& codec = "zlib", uint32_t frameBytes = 256 * 1024);
+
+	void AddWriter(const std::string& name, LogWriterPtr writer) {
+		thread::LockGuard<thread::Mutex> lock(m_configMu);
+		m_writers.Update([&](WriterMap& writers) {
+			writers.insert(std::make_pair(name, writer));
+		});
+		UpdateMinLevel();
+	}
+
+	void Flush() {
+		thread::CowPtr<WriterMap>::Reader writers(m_writers);
+		for (auto& iter : *writers) {
+			iter.second->Flush();
+		}
 	}
 
 private:
@@ -279,50 +332,96 @@ private:
 		MakeLogMsg(os, std::forward<Args>(argList)...);
 	}
 
+public:
 	template<class... Args>
 	void Log(LogLevel level, Args&&... argList) {
+		if (!Enabled(level)) {
+			return;
+		}
 		std::ostringstream os;
 		MakeLogMsg(os, std::forward<Args>(argList)...);
 		Log(std::make_shared<LogEvent>(level, os.str()));
 	}
 
+private:
 	void Log(LogEventPtr event) {
-		for (auto& iter : m_writers) {
+		thread::CowPtr<WriterMap>::Reader writers(m_writers);
+		for (auto& iter : *writers) {
 			iter.second->Log(event);
 		}
 	}
 
+	//under m_configMu
+	void UpdateMinLevel() {
+		int level = (int)LogLevel::CRITICAL;
+		thread::CowPtr<WriterMap>::Reader writers(m_writers);
+		for (auto& iter : *writers) {
+			if ((int)iter.second->GetLogLevel() < level) {
+				level = (int)iter.second->GetLogLevel();
+			}
+		}
+		m_minLevel.store(level, std::memory_order_relaxed);
+	}
+
 private:
 	LogFormaterPtr m_formater = std::make_shared<LogFormater>();
-	std::map<std::string, LogWriterPtr> m_writers;
+	thread::CowPtr<WriterMap> m_writers;
+	thread::Mutex m_configMu;
+	std::atomic<int> m_minLevel{(int)LogLevel::INFO};
 };
 
 typedef std::shared_ptr<Logger> LoggerPtr;
 
+/*
+ * loggers are created once and never dropped, so a LoggerPtr taken from here
+ * stays valid: keep it (or use QF_LOGGER) instead of looking it up per call.
+ * lookups read a copy-on-write snapshot, creating a logger copies the map
+ */
 class LoggerManager
 {
 public:
+	typedef std::unordered_map<std::string, LoggerPtr> LoggerMap;
+
 	LoggerManager() {
-		auto logger = std::make_shared<Logger>();
-		m_loggers.insert(std::make_pair("default", logger));
+		m_loggers.Update([](LoggerMap& loggers) {
+			loggers.insert(std::make_pair("default", std::make_shared<Logger>()));
+		});
 	}
 
 	LoggerPtr GetLogger(const std::string& name = "default") {
-		auto iter = m_loggers.find(name);
-		if (iter != m_loggers.end()) {
-			return iter->second;
+		{
+			thread::CowPtr<LoggerMap>::Reader loggers(m_loggers);
+			auto iter = loggers->find(name);
+			if (iter != loggers->end()) {
+				return iter->second;
+			}
 		}
-		auto logger = std::make_shared<Logger>();
-		logger->AddFileWriter(name);
-		m_loggers.insert(std::make_pair(name, logger));
+		LoggerPtr logger;
+		m_loggers.Update([&](LoggerMap& loggers) {
+			auto iter = loggers.find(name);
+			if (iter != loggers.end()) {
+				logger = iter->second;
+				return;
+			}
+			logger = std::make_shared<Logger>();
+			logger->AddFileWriter(name);
+			loggers.insert(std::make_pair(name, logger));
+		});
 		return logger;
 	}
 
 private:
-	std::map<std::string, LoggerPtr> m_loggers;
+	thread::CowPtr<LoggerMap> m_loggers;
 };
 
 }//namespace::log
 
 const log::LoggerPtr GetLogger(const std::string& name = "default");
 }
+
+// the logger named name, looked up once per call site
+#define QF_LOGGER(name) \
+	([]() -> const ::qf::log::LoggerPtr& { \
+		static const ::qf::log::LoggerPtr qfLogger_ = ::qf::GetLogger(name); \
+		return qfLogger_; \
+	}())
@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <fstream>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "profile.h"
+#include "thread.h"
+
+namespace qf {
+namespace profile {
+
+// a thread's histograms, in ticks, indexed by Site::index. written by the owner only
+struct ThreadProfile {
+	util::AtomicHistogram* hists[Site::maxSites] = {};
+};
+
+static thread::Mutex s_mu;
+static std::vector<const Site*> s_sites;
+static std::vector<ThreadProfile*> s_threads;
+//the tables of exited threads, reset, and what they had recorded by site index
+static std::vector<ThreadProfile*> s_free;
+static std::vector<util::Histogram> s_retired;
+//the sites beyond maxSites record here, it is never reported
+static util::AtomicHistogram s_discard;
+
+// merges the thread's table into the retired totals on exit and hands it to the next thread
+struct ThreadHolder {
+	~ThreadHolder() {
+		if (!prof) {
+			return;
+		}
+		thread::LockGuard<thread::Mutex> lock(s_mu);
+		for (size_t i = 0; i < s_sites.size(); i++) {
+			auto h = prof->hists[i];
+			if (h) {
+				h->MergeTo(s_retired[i]);
+				h->Reset();
+			}
+		}
+		s_threads.erase(std::find(s_threads.begin(), s_threads.end(), prof));
+		s_free.push_back(prof);
+	}
+
+	ThreadProfile* prof = nullptr;
+};
+
+static thread_local ThreadHolder t_holder;
+
+struct Clock {
+	Clock()
+		: ticks(util::ReadTicks())
+		, ns(util::NowNs()) {
+
+	}
+
+	uint64_t ticks;
+	uint64_t ns;
+};
+
+static Clock s_base;
+
+util::AtomicHistogram* RegisterHistogram(const Site& site) {
+	auto& holder = t_holder;
+	//under the lock: Collect reads the other threads' tables
+	thread::LockGuard<thread::Mutex> lock(s_mu);
+	if (site.index == Site::maxSites) {
+		if (s_sites.size() >= Site::maxSites) {
+			return &s_discard;
+		}
+		site.index = (uint32_t)s_sites.size();
+		s_sites.push_back(&site);
+		s_retired.emplace_back();
+	}
+	if (!holder.prof) {
+		if (s_free.empty()) {
+			holder.prof = new ThreadProfile;
+		} else {
+			holder.prof = s_free.back();
+			s_free.pop_back();
+		}
+		s_threads.push_back(holder.prof);
+	}
+	auto& h = holder.prof->hists[site.index];
+	//a recycled table keeps its histograms, reset when their thread exited
+	if (!h) {
+		h = new util::AtomicHistogram;
+	}
+	return h;
+}
+
+// a short spin when the process has not run long enough to tell the tick rate
+static double NsPerTick() {
+	Clock now;
+	while (now.ns - s_base.ns < 10 * 1000 * 1000) {
+		now = Clock();
+	}
+	if (now.ticks <= s_base.ticks) {
+		return 1.0;
+	}
+	return (double)(now.ns - s_base.ns) / (double)(now.ticks - s_base.ticks);
+}
+
+std::vector<SiteReport> Collect() {
+	double nsPerTick = NsPerTick();
+	std::vector<SiteReport> reports;
+	thread::LockGuard<thread::Mutex> lock(s_mu);
+	for (auto site : s_sites) {
+		util::Histogram ticks = s_retired[site->index];
+		for (auto prof : s_threads) {
+			if (prof->hists[site->index]) {
+				prof->hists[site->index]->MergeTo(ticks);
+			}
+		}
+		if (!ticks.Count()) {
+			continue;
+		}
+		reports.push_back(SiteReport{site->name, site->file, site->line, ticks, nsPerTick});
+	}
+	return reports;
+}
+
+void Report(const std::string& loggerName) {
+	auto logger = GetLogger(loggerName);
+	for (auto& report : Collect()) {
+		auto& h = report.ticks;
+		logger->Info("profile(ns)", report.name, report.file + ":" + std::to_string(report.line),
+				"count", h.Count(), "mean", report.Ns(h.Mean()), "p50", report.Ns(h.Percentile(50)),
+				"p99", report.Ns(h.Percentile(99)), "p999", report.Ns(h.Percentile(99.9)), "max", report.Ns(h.Max()));
+	}
+}
+
+static std::string JsonEscape(const std::string& s) {
+	std::string out;
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if ((unsigned char)c < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		} else {
+			out += c;
+		}
+	}
+	return out;
+}
+
+bool WriteJson(const std::string& path) {
+	std::ofstream ofs(path, std::ios::out | std::ios::trunc);
+	if (!ofs.is_open()) {
+		return false;
+	}
+	ofs << "{\"pid\":" << getpid() << ",\"unit\":\"ns\",\"sites\":[";
+	bool first = true;
+	for (auto& report : Collect()) {
+		auto& h = report.ticks;
+		ofs << (first ? "\n" : ",\n") << "{\"name\":\"" << JsonEscape(report.name) << "\",\"file\":\"" << JsonEscape(report.file)
+			<< "\",\"line\":" << report.line << ",\"count\":" << h.Count() << ",\"mean\":" << report.Ns(h.Mean())
+			<< ",\"p50\":" << report.Ns(h.Percentile(50)) << ",\"p99\":" << report.Ns(h.Percentile(99))
+			<< ",\"p999\":" << report.Ns(h.Percentile(99.9)) << ",\"max\":" << report.Ns(h.Max()) << "}";
+		first = false;
+	}
+	ofs << "\n]}\n";
+	return ofs.good();
+}
+
+}
+
+}
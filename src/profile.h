@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+#include "util.h"
+
+namespace qf {
+namespace profile {
+
+// one per QF_PROFILE_SCOPE, constant-initialized: no guard on the hot path.
+// gets its index when a thread first records it
+struct Site {
+	static constexpr uint32_t maxSites = 1024;
+
+	constexpr Site(const char* name, const char* file, int line)
+		: name(name)
+		, file(file)
+		, line(line) {
+
+	}
+
+	const char* name;
+	const char* file;
+	int line;
+	mutable uint32_t index = maxSites;	//maxSites until registered or once they ran out. guarded by the registry's lock
+};
+
+// the calling thread's histogram for site, kept by the thread until it exits. once
+// the sites ran out, one that is never reported
+util::AtomicHistogram* RegisterHistogram(const Site& site);
+
+// S is the local type QF_PROFILE_SCOPE declares: its site, and the calling thread's histogram once known
+template <class S>
+class Scope {
+public:
+	Scope()
+		: m_begin(util::ReadTicks()) {
+
+	}
+
+	~Scope() {
+		uint64_t ticks = util::ReadTicks() - m_begin;
+		//looked up here, a coroutine may end the scope on another thread than it began on
+		auto& hist = S::Hist();
+		if (!hist) {
+			hist = RegisterHistogram(S::Where());
+		}
+		hist->Record(ticks);
+	}
+
+	Scope(const Scope&) = delete;
+	Scope& operator=(const Scope&) = delete;
+
+private:
+	uint64_t m_begin;
+};
+
+struct SiteReport {
+	uint64_t Ns(uint64_t t) const {
+		return (uint64_t)(t * nsPerTick);
+	}
+
+	std::string name;
+	std::string file;
+	int line;
+	util::Histogram ticks;	//every thread's samples
+	double nsPerTick;
+};
+
+// merges the threads' histograms; safe while they keep recording
+std::vector<SiteReport> Collect();
+
+// a line per site: count, mean, p50, p99, p999 and max in ns
+void Report(const std::string& loggerName = "default");
+
+bool WriteJson(const std::string& path);
+
+}
+
+}
+
+/*
+ * times the rest of the enclosing block into the calling thread's histogram for
+ * this call site: two tick reads, a thread_local load and a few relaxed stores, no
+ * locks once a thread has seen the site. a scope held across a coroutine switch
+ * also times the wait. a thread's histograms are merged into the totals when it exits.
+ * compiled out unless QF_PROFILE_ENABLED is defined (cmake -DQF_PROFILE=ON)
+ */
+#ifdef QF_PROFILE_ENABLED
+#define QF_PROFILE_CONCAT2(a, b) a##b
+#define QF_PROFILE_CONCAT(a, b) QF_PROFILE_CONCAT2(a, b)
+#define QF_PROFILE_SCOPE(name) \
+	struct QF_PROFILE_CONCAT(QfProfileSite, __LINE__) { \
+		static ::util::AtomicHistogram*& Hist() { \
+			static thread_local ::util::AtomicHistogram* hist = nullptr; \
+			return hist; \
+		} \
+		static const qf::profile::Site& Where() { \
+			static const qf::profile::Site site(name, __FILE__, __LINE__); \
+			return site; \
+		} \
+	}; \
+	qf::profile::Scope<QF_PROFILE_CONCAT(QfProfileSite, __LINE__)> QF_PROFILE_CONCAT(qfProfileScope, __LINE__)
+#else
+#define QF_PROFILE_SCOPE(name) do {} while (0)
+#endif
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <atomic>
+#include <ostream>
+#include <stdint.h>
+
+#include "log.h"
+#include "thread.h"
+#include "util.h"
+
+namespace qf {
+namespace log {
+
+/*
+ * per call-site limits for hot log statements. the state is a static at the
+ * call site, touched with relaxed atomics only, and a dropped message is never
+ * formatted: it costs the level check, a coarse clock read, a load of the site
+ * and a bump of the calling thread's own counter
+ */
+
+// 1-in-n sampling. racing threads may lose a hit now and then, which only skews the sample
+class SampleSite {
+public:
+	explicit SampleSite(uint32_t n)
+		: m_n(n ? n : 1) {
+
+	}
+
+	bool Allow() {
+		uint64_t hits = m_hits.load(std::memory_order_relaxed);
+		m_hits.store(hits + 1, std::memory_order_relaxed);
+		return hits % m_n == 0;
+	}
+
+private:
+	std::atomic<uint64_t> m_hits{0};
+	uint32_t m_n;
+};
+
+struct Suppressed {
+	uint64_t n;
+};
+
+inline std::ostream& operator<<(std::ostream& os, const Suppressed& s) {
+	return os << "(" << s.n << " messages suppressed)";
+}
+
+/*
+ * token bucket of perSec tokens a second holding up to burst, kept as a single
+ * theoretical arrival time (GCRA). a thread counts the messages it drops in a
+ * counter of its own; the next message let through, from any thread, and
+ * ReportSuppressed collect what all counters gained since they were last read.
+ * a thread's counter goes back to the site when it exits, still holding its
+ * drops, so no count is lost. sites register themselves for ReportSuppressed
+ * and must be statics
+ */
+class RateLimitSite {
+public:
+	// written by its thread only, read under the site's lock
+	struct alignas(64) Counter : util::AlignedNew<Counter> {
+		std::atomic<uint64_t> dropped{0};
+		uint64_t reported = 0;
+		bool free = false;
+		Counter* next = nullptr;
+	};
+
+	RateLimitSite(const char* file, int line, uint32_t perSec, uint32_t burst = 0);
+
+	// counter is the calling thread's for this site, a thread_local at the call site taken on the first drop
+	bool Allow(Counter*& counter) {
+		uint64_t now = util::CoarseNowNs();
+		uint64_t tat = m_tat.load(std::memory_order_relaxed);
+		while (true) {
+			uint64_t base = tat > now ? tat : now;
+			if (base - now > m_tolerance) {
+				if (!counter) {
+					counter = Acquire();
+				}
+				uint64_t n = counter->dropped.load(std::memory_order_relaxed);
+				counter->dropped.store(n + 1, std::memory_order_relaxed);
+				return false;
+			}
+			if (m_tat.compare_exchange_weak(tat, base + m_interval, std::memory_order_relaxed)) {
+				return true;
+			}
+		}
+	}
+
+	template<class... Args>
+	void Emit(Logger& logger, LogLevel level, Args&&... argList) {
+		uint64_t n = TakeSuppressed();
+		if (n) {
+			logger.Log(level, std::forward<Args>(argList)..., Suppressed{ n });
+		} else {
+			logger.Log(level, std::forward<Args>(argList)...);
+		}
+	}
+
+	// the drops of all threads since the last call
+	uint64_t TakeSuppressed();
+
+	const char* File() const {
+		return m_file;
+	}
+
+	int Line() const {
+		return m_line;
+	}
+
+	RateLimitSite* Next() const {
+		return m_next;
+	}
+
+private:
+	friend struct ThreadCounters;
+
+	// a free counter of an exited thread, or a new one; it goes back when the calling thread exits
+	Counter* Acquire();
+
+	void Release(Counter* counter);
+
+private:
+	std::atomic<uint64_t> m_tat{0};
+	uint64_t m_interval;
+	uint64_t m_tolerance;
+	thread::Mutex m_mu;	//guards the counters' reported and free, and the list
+	Counter* m_counters = nullptr;
+	const char* m_file;
+	int m_line;
+	RateLimitSite* m_next = nullptr;
+};
+
+// logs "file:line N messages suppressed" for every site whose threads dropped messages since the last report
+void ReportSuppressed(const LoggerPtr& logger, LogLevel level = LogLevel::WARNING);
+
+}
+
+}
+
+// QF_LOG_EVERY_N(logger, WARNING, 1000, "slow request", id) logs one call in 1000
+#define QF_LOG_EVERY_N(logger, level, n, ...) \
+	do { \
+		static ::qf::log::SampleSite qfSite_(n); \
+		auto& qfLogger_ = (logger); \
+		if (qfLogger_->Enabled(::qf::log::LogLevel::level) && qfSite_.Allow()) { \
+			qfLogger_->Log(::qf::log::LogLevel::level, __VA_ARGS__); \
+		} \
+	} while (0)
+
+// QF_LOG_RATE(logger, WARNING, 10, "queue full", size) logs at most 10 calls a second, in bursts of up to 10
+#define QF_LOG_RATE(logger, level, perSec, ...) \
+	do { \
+		static ::qf::log::RateLimitSite qfSite_(__FILE__, __LINE__, (perSec)); \
+		static thread_local ::qf::log::RateLimitSite::Counter* qfDropped_ = nullptr; \
+		auto& qfLogger_ = (logger); \
+		if (qfLogger_->Enabled(::qf::log::LogLevel::level) && qfSite_.Allow(qfDropped_)) { \
+			qfSite_.Emit(*qfLogger_, ::qf::log::LogLevel::level, __VA_ARGS__); \
+		} \
+	} while (0)
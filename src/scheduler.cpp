@@ -1,50 +1,596 @@
 #include "scheduler.h"
 
+#include <algorithm>
+
+#include "group.h"
+#include "io.h"
 #include "log.h"
+#include "trace.h"
 
 namespace qf {
 namespace co {
 
-Scheduler::Scheduler(uint32_t threadNum) : m_threadNum(threadNum) {
+Scheduler::Scheduler(uint32_t threadNum) : m_local(threadNum), m_threadNum(threadNum) {
+	for (uint32_t i = 0; i < m_threadNum; i++) {
+		m_counters.emplace_back(new WorkerCounter());
+	}
+	m_localHighWater.resize(m_threadNum);
+	m_localFresh.resize(m_threadNum);
 	for (uint32_t i = 1; i < m_threadNum; i++) {
 		auto thread = thread::CreateThread(&Main, this, i);
 		m_threads.push_back(thread);
 	}
 }
 
+Scheduler::~Scheduler() {
+	thread::LockGuard<thread::Mutex> lock(m_blockMu);
+	m_blockStop = true;
+	m_blockCond.Broadcast();
+	while (!m_blockThreads.empty()) {
+		m_blockExitCond.Wait(m_blockMu);
+	}
+	for (auto& thread : m_blockExited) {
+		thread->Join();
+	}
+}
+
 void Scheduler::Run() {
+	m_startNs = util::NowNs();
+	m_lastDumpNs = m_startNs;
+	{
+		thread::LockGuard<thread::Mutex> lock(mu);
+		m_running = true;
+		m_stalled = false;
+	}
+
 	for (auto& thread : m_threads) {
 		thread->Run();
 	}
+	thread::ThreadPtr watchdog;
+	if (m_sliceNs || m_longTaskNs) {
+		m_watchStop = false;
+		watchdog = thread::CreateThread(&Watchdog, this);
+		watchdog->Run();
+	}
 
 	Main(this, 0);
 
+	bool stalled;
+	{
+		//producers still waiting for room get rejected now
+		thread::LockGuard<thread::Mutex> lock(mu);
+		m_running = false;
+		m_spaceCond.Broadcast();
+		stalled = m_stalled;
+	}
+	if (stalled) {
+		GetLogger()->Error("scheduler gave up on", m_pending.load(std::memory_order_relaxed),
+				"suspended tasks, nothing left could resume them");
+	}
+	if (watchdog) {
+		{
+			thread::LockGuard<thread::Mutex> lock(m_watchMu);
+			m_watchStop = true;
+			m_watchCond.Signal();
+		}
+		watchdog->Join();
+	}
+
 	for (auto& thread : m_threads) {
 		thread->Join();
 	}
+
+	if (m_dumpIntervalNs) {
+		DumpStats();
+	}
+}
+
+static thread_local Scheduler* t_scheduler = nullptr;
+thread_local std::atomic<bool>* Scheduler::t_preempt = nullptr;
+thread_local Coroutine* Scheduler::t_task = nullptr;
+thread_local GroupState* Scheduler::t_group = nullptr;
+thread_local const std::atomic<bool>* Scheduler::t_cancelled = nullptr;
+static thread_local uint32_t t_threadNo = 0;
+
+Scheduler* Scheduler::Current() {
+	return t_scheduler;
+}
+
+bool Scheduler::InTask() {
+	auto& co = GetManager()->GetRunning();
+	return co && co.get() == t_task;
+}
+
+void Scheduler::SetCapacity(uint64_t tasks, uint64_t perWorker, Overflow policy) {
+	thread::LockGuard<thread::Mutex> lock(mu);
+	m_capacity = tasks;
+	m_workerCapacity = perWorker;
+	m_overflow = policy;
+	m_spaceCond.Broadcast();
+}
+
+bool Scheduler::Full(uint32_t threadNo) const {
+	if (m_capacity && m_fresh >= m_capacity) {
+		return true;
+	}
+	return m_workerCapacity && threadNo != m_maxThreadNo && m_localFresh[threadNo] >= m_workerCapacity;
+}
+
+bool Scheduler::ShedOldest(uint32_t threadNo, util::Func& shed) {
+	//a full worker queue only gets room from itself, the global limit from any queue
+	bool workerFull = m_workerCapacity && threadNo != m_maxThreadNo && m_localFresh[threadNo] >= m_workerCapacity;
+	std::vector<std::deque<Task>*> queues;
+	if (workerFull) {
+		queues.push_back(&m_local[threadNo]);
+	} else {
+		queues.push_back(&m_shared);
+		for (auto& local : m_local) {
+			queues.push_back(&local);
+		}
+	}
+	std::deque<Task>* from = nullptr;
+	std::deque<Task>::iterator oldest;
+	for (auto queue : queues) {
+		for (auto iter = queue->begin(); iter != queue->end(); iter++) {
+			if (iter->background && (!from || iter->seq < oldest->seq)) {
+				from = queue;
+				oldest = iter;
+			}
+			//later ones in the same queue are younger
+			if (iter->background) {
+				break;
+			}
+		}
+	}
+	if (!from) {
+		return false;
+	}
+	shed = std::move(oldest->func);
+	TaskTaken(*oldest);
+	from->erase(oldest);
+	m_shed++;
+	//GetTask reads it under mu only, and the task taking its place is counted first
+	m_pending.fetch_sub(1, std::memory_order_relaxed);
+	return true;
+}
+
+void Scheduler::TaskTaken(const Task& task) {
+	m_queued--;
+	if (task.co || task.inlineRun) {
+		return;
+	}
+	m_fresh--;
+	if (task.threadNo != m_maxThreadNo) {
+		m_localFresh[task.threadNo]--;
+	}
+	if (m_spaceWaiters) {
+		m_spaceCond.Signal();
+	}
+	if (!m_coWaiters.empty()) {
+		//it retries once resumed
+		auto waiter = std::move(m_coWaiters.front());
+		m_coWaiters.pop_front();
+		m_shared.push_back(Task{ util::Func(), m_maxThreadNo, 0, std::move(waiter), false, false, nullptr, m_seq++ });
+		m_queued++;
+		if (m_idle) {
+			m_cond.Broadcast();
+		}
+	}
+}
+
+bool Scheduler::Push(util::Func&& func, uint32_t threadNo, CoroutinePtr co, bool inlineRun, Admit admit, bool background,
+		GroupState* group) {
+	if (!co) {
+		func = InheritLocals(std::move(func));
+	}
+	bool fresh = !co;
+	bool limited = fresh && !inlineRun && admit != Admit::ALWAYS;
+	util::Func shed;	//destroyed once mu is released
+	thread::UniqueLock<thread::Mutex> lock(mu);
+	while (limited && Full(threadNo)) {
+		if (admit == Admit::POLICY && m_overflow == Overflow::SHED_OLDEST && ShedOldest(threadNo, shed)) {
+			break;
+		}
+		if (admit == Admit::TRY || m_overflow != Overflow::BLOCK || !m_running) {
+			m_rejected++;
+			return false;
+		}
+		//a worker waiting on itself would never wake, nor would a coroutine its task resumes
+		if (t_scheduler == this && !InTask()) {
+			break;
+		}
+		auto self = Running();
+		m_blocked++;
+		if (t_scheduler == this) {
+			lock.Unlock();
+			//queued as a waiter once off its stack, unless room opened meanwhile
+			YieldWith(util::CreateFunc([this, self, threadNo]() {
+				thread::LockGuard<thread::Mutex> guard(mu);
+				m_coWaiters.push_back(self);
+				if (!Full(threadNo) || !m_running) {
+					m_coWaiters.pop_back();
+					m_shared.push_back(Task{ util::Func(), m_maxThreadNo, 0, self, false, false, nullptr, m_seq++ });
+					m_queued++;
+					if (m_idle) {
+						m_cond.Broadcast();
+					}
+				}
+			}));
+			lock.Lock();
+		} else {
+			m_spaceWaiters++;
+			m_spaceCond.Wait(mu);
+			m_spaceWaiters--;
+		}
+	}
+	uint64_t now = m_statsEnabled.load(std::memory_order_relaxed) ? util::NowNs() : 0;
+	bool pinned = threadNo != m_maxThreadNo;
+	auto& queue = pinned ? m_local[threadNo] : m_shared;
+	queue.push_back(Task{ std::move(func), threadNo, now, std::move(co), inlineRun, background, group, m_seq++ });
+	if (fresh) {
+		m_pending.fetch_add(1, std::memory_order_relaxed);
+		m_scheduled++;
+		if (!inlineRun) {
+			m_fresh++;
+			if (pinned) {
+				m_localFresh[threadNo]++;
+			}
+		}
+	}
+	if (++m_queued > m_queueHighWater) {
+		m_queueHighWater = m_queued;
+	}
+	if (pinned && queue.size() > m_localHighWater[threadNo]) {
+		m_localHighWater[threadNo] = queue.size();
+	}
+	if (m_idle) {
+		m_cond.Broadcast();
+	}
+	return true;
+}
+
+std::vector<util::Func> Scheduler::RemoveGroup(const GroupState* group) {
+	std::vector<Task> taken;
+	thread::LockGuard<thread::Mutex> lock(mu);
+	auto take = [&](std::deque<Task>& queue) {
+		for (auto iter = queue.begin(); iter != queue.end();) {
+			if (iter->group == group && !iter->co) {
+				taken.push_back(std::move(*iter));
+				iter = queue.erase(iter);
+			} else {
+				iter++;
+			}
+		}
+	};
+	take(m_shared);
+	for (auto& local : m_local) {
+		take(local);
+	}
+	//only now: TaskTaken may queue coroutines waiting for room
+	std::vector<util::Func> removed;
+	for (auto& task : taken) {
+		TaskTaken(task);
+		removed.push_back(std::move(task.func));
+	}
+	m_cancelled += taken.size();
+	if (!taken.empty() && m_pending.fetch_sub(taken.size(), std::memory_order_relaxed) == taken.size()) {
+		m_cond.Broadcast();
+	}
+	return removed;
+}
+
+void Scheduler::ScheduleCo(const CoroutinePtr& co, uint32_t threadNo) {
+	Push(util::Func(), threadNo == m_maxThreadNo ? threadNo : threadNo % m_threadNum, co);
+}
+
+void Scheduler::PushBlocking(util::Func&& func, bool counted) {
+	//pool threads have no coroutine: the locals are there only for the job's call
+	if (counted) {
+		func = InheritLocals(std::move(func));
+	}
+	m_blockBusy.fetch_add(1, std::memory_order_relaxed);
+	thread::LockGuard<thread::Mutex> lock(m_blockMu);
+	m_blockQueue.push_back(BlockingJob{ std::move(func), counted });
+	for (auto& thread : m_blockExited) {
+		thread->Join();
+	}
+	m_blockExited.clear();
+	//grow only when every idle thread already has a job to take
+	if (m_blockQueue.size() > m_blockIdle && m_blockThreads.size() < m_blockMax) {
+		uint64_t id = m_blockNextId++;
+		auto thread = thread::CreateThread(&BlockingMain, this, id);
+		m_blockThreads[id] = thread;
+		if (m_blockThreads.size() > m_blockPeak) {
+			m_blockPeak = (uint32_t)m_blockThreads.size();
+		}
+		thread->Run();
+	} else {
+		m_blockCond.Signal();
+	}
+}
+
+void Scheduler::BlockingMain(Scheduler* self, uint64_t id) {
+	auto& mu = self->m_blockMu;
+	mu.Lock();
+	while (!self->m_blockStop) {
+		if (!self->m_blockQueue.empty()) {
+			auto job = std::move(self->m_blockQueue.front());
+			self->m_blockQueue.pop_front();
+			self->m_blockRun++;
+			mu.Unlock();
+			job.func();
+			if (job.counted) {
+				self->Done();
+			}
+			job = BlockingJob();
+			//after the job requeued its coroutine
+			self->m_blockBusy.fetch_sub(1, std::memory_order_release);
+			mu.Lock();
+			continue;
+		}
+		self->m_blockIdle++;
+		bool woken = self->m_blockCond.TimedWait(mu, self->m_blockIdleNs);
+		self->m_blockIdle--;
+		//shrink: a thread that sat out a whole idle period leaves
+		if (!woken && self->m_blockQueue.empty()) {
+			break;
+		}
+	}
+	//a thread cannot join itself, the next PushBlocking or the destructor does
+	auto iter = self->m_blockThreads.find(id);
+	self->m_blockExited.push_back(iter->second);
+	self->m_blockThreads.erase(iter);
+	self->m_blockExitCond.Broadcast();
+	mu.Unlock();
+}
+
+void Scheduler::Preempt(uint32_t threadNo) {
+	//a nested coroutine is resumed by its task, requeued it would run twice
+	if (!InTask() || t_scheduler != this) {
+		return;
+	}
+	auto self = Running();
+	auto& counter = *m_counters[t_threadNo];
+	counter.slice.preempt.store(false, std::memory_order_relaxed);
+	WorkerCounter::Bump(counter.preempted, 1);
+	//by default to the shared queue, an idle worker may take it before this one is free again
+	YieldWith(util::CreateFunc([this, self, threadNo]() {
+		ScheduleCo(self, threadNo);
+	}));
+}
+
+void Scheduler::Watchdog(Scheduler* self) {
+	uint64_t period = UINT64_MAX;
+	for (uint64_t ns : { self->m_sliceNs, self->m_longTaskNs }) {
+		if (ns && ns / 2 < period) {
+			period = ns / 2;
+		}
+	}
+	period = std::max<uint64_t>(period, 100000);
+	auto logger = GetLogger(self->m_watchLogger);
+	thread::LockGuard<thread::Mutex> lock(self->m_watchMu);
+	while (!self->m_watchStop) {
+		self->m_watchCond.TimedWait(self->m_watchMu, period);
+		uint64_t now = util::NowNs();
+		for (uint32_t i = 0; i < self->m_threadNum; i++) {
+			auto& counter = *self->m_counters[i];
+			uint64_t start = counter.slice.start.load(std::memory_order_acquire);
+			if (!start || now < start) {
+				continue;
+			}
+			if (self->m_sliceNs && now - start >= self->m_sliceNs) {
+				counter.slice.preempt.store(true, std::memory_order_relaxed);
+			}
+			if (self->m_longTaskNs && now - start >= self->m_longTaskNs && counter.slice.reported != start) {
+				counter.slice.reported = start;
+				WorkerCounter::Bump(counter.longTasks, 1);
+				logger->Warning("worker", i, "task", util::TypeName(counter.slice.type.load(std::memory_order_relaxed)),
+						"running for(ms)", (now - start) / 1000000);
+			}
+		}
+	}
 }
 
-util::Func Scheduler::GetFunc(uint32_t threadNo) {
+void RunBlocking(util::Func&& func) {
+	auto sc = Scheduler::Current();
+	//a nested coroutine cannot be resumed by the pool, it runs func in place
+	if (!sc || !Scheduler::InTask()) {
+		func();
+		return;
+	}
+	auto self = Running();
+	//locals are taken here, the handover below runs outside the coroutine
+	auto job = std::make_shared<util::Func>(InheritLocals(std::move(func)));
+	//handed over once off this stack, the pool thread may resume it right after
+	YieldWith(util::CreateFunc([sc, self, job]() {
+		sc->PushBlocking(util::CreateFunc([sc, self, job]() {
+			(*job)();
+			sc->ScheduleCo(self);
+		}), false);
+	}));
+}
+
+bool Scheduler::GetTask(uint32_t threadNo, Task& task, bool park) {
 	thread::LockGuard<thread::Mutex> lock(mu);
-	for (auto iter =  m_list.begin(); iter != m_list.end(); iter++) {
-		if (iter->second == m_maxThreadNo || iter->second == threadNo) {
-			util::Func func = iter->first;
-			m_list.erase(iter);
-			return func;
+	while (true) {
+		//pinned work first, it can go nowhere else
+		auto& local = m_local[threadNo];
+		auto& queue = local.empty() ? m_shared : local;
+		if (!queue.empty()) {
+			task = std::move(queue.front());
+			queue.pop_front();
+			TaskTaken(task);
+			return true;
+		}
+		if (m_pending.load(std::memory_order_relaxed) == 0 || m_stalled) {
+			m_cond.Broadcast();
+			return false;
+		}
+		if (!park) {
+			return false;
+		}
+		QF_TRACE(PARK, threadNo);
+		m_idle++;
+		//the last worker to park watches for tasks that were suspended and forgotten
+		if (m_idle == m_threadNum && m_stallNs) {
+			if (!m_cond.TimedWait(mu, m_stallNs) && m_idle == m_threadNum && m_queued == 0
+					&& m_blockBusy.load(std::memory_order_acquire) == 0
+					&& m_pending.load(std::memory_order_relaxed) > 0) {
+				m_stalled = true;
+			}
+		} else {
+			m_cond.Wait(mu);
+		}
+		m_idle--;
+		QF_TRACE(UNPARK, threadNo);
+	}
+}
+
+void Scheduler::Done() {
+	if (m_pending.fetch_sub(1) == 1) {
+		thread::LockGuard<thread::Mutex> lock(mu);
+		m_cond.Broadcast();
+	}
+}
+
+SchedulerStats Scheduler::Stats() {
+	SchedulerStats stats;
+	{
+		thread::LockGuard<thread::Mutex> lock(mu);
+		stats.scheduled = m_scheduled;
+		stats.queueDepth = m_queued;
+		stats.queueHighWater = m_queueHighWater;
+		stats.capacity = m_capacity;
+		stats.rejected = m_rejected;
+		stats.shed = m_shed;
+		stats.blocked = m_blocked;
+		stats.cancelled = m_cancelled;
+		for (uint32_t i = 0; i < m_threadNum; i++) {
+			stats.workers.emplace_back();
+			stats.workers.back().queueHighWater = m_localHighWater[i];
 		}
 	}
-	return util::Func();
+	{
+		thread::LockGuard<thread::Mutex> lock(m_blockMu);
+		stats.blockingRun = m_blockRun;
+		stats.blockingThreads = (uint32_t)m_blockThreads.size();
+		stats.blockingPeak = m_blockPeak;
+	}
+	stats.uptimeNs = util::NowNs() - m_startNs;
+	for (uint32_t i = 0; i < m_threadNum; i++) {
+		auto& counter = *m_counters[i];
+		auto& ws = stats.workers[i];
+		ws.threadNo = i;
+		ws.executed = counter.executed.load(std::memory_order_relaxed);
+		ws.pinned = counter.pinned.load(std::memory_order_relaxed);
+		ws.shared = ws.executed - ws.pinned;
+		ws.busyNs = counter.busyNs.load(std::memory_order_relaxed);
+		ws.preempted = counter.preempted.load(std::memory_order_relaxed);
+		ws.longTasks = counter.longTasks.load(std::memory_order_relaxed);
+		counter.waitNs.MergeTo(ws.waitNs);
+		counter.runNs.MergeTo(ws.runNs);
+		stats.waitNs.Merge(ws.waitNs);
+		stats.runNs.Merge(ws.runNs);
+	}
+	return stats;
+}
+
+void Scheduler::DumpStats() {
+	auto logger = GetLogger(m_dumpLogger);
+	auto stats = Stats();
+	logger->Info("scheduler scheduled", stats.scheduled, "queue", stats.queueDepth,
+			"highwater", stats.queueHighWater, "uptime(ms)", stats.uptimeNs / 1000000);
+	if (stats.cancelled) {
+		logger->Info("cancelled queued", stats.cancelled);
+	}
+	if (stats.capacity || stats.rejected || stats.shed) {
+		logger->Info("admission capacity", stats.capacity, "rejected", stats.rejected,
+				"shed", stats.shed, "blocked", stats.blocked);
+	}
+	if (stats.blockingRun) {
+		logger->Info("blocking run", stats.blockingRun, "threads", stats.blockingThreads,
+				"peak", stats.blockingPeak);
+	}
+	for (auto& ws : stats.workers) {
+		uint64_t busy = stats.uptimeNs ? ws.busyNs * 100 / stats.uptimeNs : 0;
+		logger->Info("worker", ws.threadNo, "executed", ws.executed, "pinned", ws.pinned,
+				"preempted", ws.preempted, "busy(%)", busy);
+	}
+	logger->Info("scheduler wait(ns)", stats.waitNs.Summary());
+	logger->Info("scheduler run(ns)", stats.runNs.Summary());
 }
 
 void Scheduler::Main(Scheduler* self, uint32_t threadNo) {
+	t_scheduler = self;
+	t_threadNo = threadNo;
+	auto& counter = *self->m_counters[threadNo];
+	t_preempt = &counter.slice.preempt;
+	bool watched = self->m_sliceNs || self->m_longTaskNs;
+	Task task;
 	while (true) {
-		if (auto func = self->GetFunc(threadNo)) {
-			auto co = GetManager()->_create(func);
-			Resume(co);
+		//a worker with io in flight polls its ring instead of parking on the condvar
+		io::WorkerReap();
+		bool waitingIo = io::WorkerInflight() > 0;
+		if (!self->GetTask(threadNo, task, !waitingIo)) {
+			if (!waitingIo) {
+				break;
+			}
+			io::WorkerWait(1000000);
+			continue;
+		}
+		QF_TRACE(TASK_DEQUEUE, (int32_t)task.threadNo);
+		bool timed = task.enqueueNs && self->m_statsEnabled.load(std::memory_order_relaxed);
+		uint64_t begin = timed ? util::NowNs() : 0;
+
+		if (task.inlineRun) {
+			task.func();
+			self->Done();
 		} else {
-			break;
+			auto co = task.co;
+			if (!co) {
+				co = GetManager()->_create(task.func);
+				co->group = task.group;
+			}
+			t_task = co.get();
+			t_group = co->group;
+			t_cancelled = co->group ? &co->group->cancelled : nullptr;
+			if (watched) {
+				counter.slice.preempt.store(false, std::memory_order_relaxed);
+				counter.slice.type.store(co->func.Type(), std::memory_order_relaxed);
+				counter.slice.start.store(begin ? begin : util::NowNs(), std::memory_order_release);
+			}
+			//otherwise it handed itself to whoever wakes it up, and may be running there already
+			bool dead = GetManager()->Resume(co);
+			t_task = nullptr;
+			t_group = nullptr;
+			t_cancelled = nullptr;
+			if (watched) {
+				counter.slice.start.store(0, std::memory_order_relaxed);
+			}
+			if (dead) {
+				self->Done();
+			}
+		}
+
+		WorkerCounter::Bump(counter.executed, 1);
+		if (task.threadNo != self->m_maxThreadNo) {
+			WorkerCounter::Bump(counter.pinned, 1);
+		}
+		uint64_t end = (timed || self->m_dumpIntervalNs) ? util::NowNs() : 0;
+		if (timed) {
+			counter.waitNs.Record(begin - task.enqueueNs);
+			counter.runNs.Record(end - begin);
+			WorkerCounter::Bump(counter.busyNs, end - begin);
+		}
+		if (threadNo == 0 && self->m_dumpIntervalNs
+				&& end - self->m_lastDumpNs >= self->m_dumpIntervalNs) {
+			self->m_lastDumpNs = end;
+			self->DumpStats();
 		}
+		task = Task();
 	}
+	t_preempt = nullptr;
+	t_scheduler = nullptr;
 }
 
 }
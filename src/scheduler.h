@@ -1,48 +1,394 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
 #include <list>
+#include <map>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "coroutine.h"
+#include "histogram.h"
 #include "thread.h"
 #include "util.h"
 
 namespace qf {
 namespace co {
 
+struct WorkerStats {
+	uint32_t threadNo = 0;
+	uint64_t executed = 0;
+	uint64_t pinned = 0;	//taken from TSchedule
+	uint64_t shared = 0;	//taken from Schedule
+	uint64_t queueHighWater = 0;	//of its own queue
+	uint64_t preempted = 0;	//slices cut short at a MaybeYield
+	uint64_t longTasks = 0;	//slices the watchdog reported
+	uint64_t busyNs = 0;
+	util::Histogram waitNs;	//enqueue -> dequeue, per queue entry
+	util::Histogram runNs;	//per slice: a Resume of a task or of a coroutine woken up, until it switches out
+};
+
+struct SchedulerStats {
+	uint64_t scheduled = 0;
+	uint64_t queueDepth = 0;
+	uint64_t queueHighWater = 0;
+	uint64_t capacity = 0;	//0 unbounded
+	uint64_t rejected = 0;
+	uint64_t shed = 0;
+	uint64_t blocked = 0;	//producers that had to wait for room
+	uint64_t cancelled = 0;	//queued tasks a cancelled TaskGroup took back
+	uint64_t blockingRun = 0;	//jobs the blocking pool took
+	uint32_t blockingThreads = 0;
+	uint32_t blockingPeak = 0;
+	uint64_t uptimeNs = 0;
+	std::vector<WorkerStats> workers;
+	util::Histogram waitNs;
+	util::Histogram runNs;
+};
+
+// what Schedule does with a task that finds its queue at capacity
+enum class Overflow {
+	BLOCK,	//wait for room; a coroutine producer suspends instead of holding its worker
+	REJECT,	//Schedule returns false
+	SHED_OLDEST,	//drop the oldest queued ScheduleBackground task for it, reject if there is none
+};
+
+class TaskGroup;
+
 class Scheduler {
 public:
 	Scheduler(uint32_t threadNum = 3);
 
+	~Scheduler();
+
+	// false when the task was refused, see SetCapacity
+	template<class F, class... ArgList>
+	bool Schedule(F&& f, ArgList&&... argList) {
+		auto func = util::CreateFunc(std::forward<F>(f), std::forward<ArgList>(argList)...);
+		return Push(std::move(func), m_maxThreadNo);
+	}
+
+	template<class F, class... ArgList>
+	bool TSchedule(const uint32_t key, F&& f, ArgList&&... argList) {
+		auto func = util::CreateFunc(std::forward<F>(f), std::forward<ArgList>(argList)...);
+		return Push(std::move(func), key % m_threadNum);
+	}
+
+	// never waits: false at capacity whatever the policy
+	template<class F, class... ArgList>
+	bool TrySchedule(F&& f, ArgList&&... argList) {
+		auto func = util::CreateFunc(std::forward<F>(f), std::forward<ArgList>(argList)...);
+		return Push(std::move(func), m_maxThreadNo, nullptr, false, Admit::TRY);
+	}
+
+	// work that may be dropped under SHED_OLDEST to make room for newer tasks
+	template<class F, class... ArgList>
+	bool ScheduleBackground(F&& f, ArgList&&... argList) {
+		auto func = util::CreateFunc(std::forward<F>(f), std::forward<ArgList>(argList)...);
+		return Push(std::move(func), m_maxThreadNo, nullptr, false, Admit::POLICY, true);
+	}
+
+	/*
+	 * bounds the tasks queued and not started yet: tasks in all queues, and perWorker
+	 * in each worker's own queue (TSchedule). 0 is unbounded. resumed coroutines and
+	 * stackless tasks are work already admitted and never count. BLOCK only waits
+	 * while Run is running; before it, or from a worker outside a coroutine, nothing
+	 * could make room, and the task is rejected or admitted over capacity respectively
+	 */
+	void SetCapacity(uint64_t tasks, uint64_t perWorker = 0, Overflow policy = Overflow::BLOCK);
+
+	// for the runtime's own continuations of admitted work (actor drains, awaiters):
+	// never refused nor held back by SetCapacity. threadNo -1 is any worker
+	void ScheduleAdmitted(util::Func&& func, uint32_t threadNo = (uint32_t)-1) {
+		Push(std::move(func), threadNo == m_maxThreadNo ? threadNo : threadNo % m_threadNum, nullptr, false,
+				Admit::ALWAYS);
+	}
+
+	// a task of a TaskGroup: Cancel finds it by group while it is queued
+	bool ScheduleInGroup(util::Func&& func, GroupState* group) {
+		return Push(std::move(func), m_maxThreadNo, nullptr, false, Admit::POLICY, false, group);
+	}
+
+	// takes the group's queued tasks off the queues, resumed coroutines stay. returns their funcs
+	std::vector<util::Func> RemoveGroup(const GroupState* group);
+
+	// runs f directly on the worker stack, without a coroutine of its own.
+	// f must not Yield; used to resume stackless tasks
 	template<class F, class... ArgList>
-	void Schedule(F&& f, ArgList&&... argList) {
-		auto func = util::CreateFunc(std::forward<F>(f), std::forward<ArgList...>(argList)...);
-		thread::LockGuard<thread::Mutex> lock(mu);
-		m_list.emplace_back(std::move(func), m_maxThreadNo);
+	void ScheduleInline(F&& f, ArgList&&... argList) {
+		auto func = util::CreateFunc(std::forward<F>(f), std::forward<ArgList>(argList)...);
+		Push(std::move(func), m_maxThreadNo, nullptr, true, Admit::ALWAYS);
 	}
 
+	// runs f on the blocking pool, apart from the workers. for calls that sleep in the
+	// kernel or a library: DNS, fsync, legacy clients. Run waits for it like any task
 	template<class F, class... ArgList>
-	void TSchedule(const uint32_t key, F&& f, ArgList&&... argList) {
-		auto func = util::CreateFunc(std::forward<F>(f), std::forward<ArgList...>(argList)...);
-		thread::LockGuard<thread::Mutex> lock(mu);
-		m_list.emplace_back(std::move(func), key % m_threadNum);
+	void ScheduleBlocking(F&& f, ArgList&&... argList) {
+		auto func = util::CreateFunc(std::forward<F>(f), std::forward<ArgList>(argList)...);
+		m_pending.fetch_add(1, std::memory_order_relaxed);
+		PushBlocking(std::move(func), true);
+	}
+
+	// the blocking pool grows to maxThreads while jobs wait, threads idle for idleMs exit
+	void SetBlockingPool(uint32_t maxThreads, uint32_t idleMs) {
+		m_blockMax = maxThreads ? maxThreads : 1;
+		m_blockIdleNs = (uint64_t)idleMs * 1000000;
 	}
 
+	// queues a suspended coroutine to be resumed by a worker. to wake a coroutine
+	// that suspends itself, hand it over from YieldWith so it is off its stack first
+	void ScheduleCo(const CoroutinePtr& co, uint32_t threadNo = (uint32_t)-1);
+
+	// returns once every task, including the ones they scheduled or are waiting on, is done
 	void Run();
 
+	/*
+	 * how long Run waits, every worker idle with nothing queued, in io or on the
+	 * blocking pool, before it gives up on the tasks still suspended: nothing here
+	 * can resume them. 0 waits for ever, for coroutines woken from other threads
+	 */
+	void SetStallTimeout(uint32_t ms) {
+		m_stallNs = (uint64_t)ms * 1000000;
+	}
+
+	// the scheduler whose worker is running the calling thread, if any
+	static Scheduler* Current();
+
+	uint32_t ThreadNum() const {
+		return m_threadNum;
+	}
+
+	// timing of queue wait and run time, on by default. counters are always kept
+	void EnableStats(bool enable) {
+		m_statsEnabled.store(enable, std::memory_order_relaxed);
+	}
+
+	// worker 0 logs Stats() every intervalMs between tasks, and once more when Run returns
+	void SetStatsDump(uint32_t intervalMs, const std::string& loggerName = "default") {
+		m_dumpIntervalNs = (uint64_t)intervalMs * 1000000;
+		m_dumpLogger = loggerName;
+	}
+
+	/*
+	 * time slices. a task that ran sliceUs without suspending yields at its next
+	 * MaybeYield, so the tasks queued behind it get their turn. one still running
+	 * after reportMs is logged with its type, once per slice, whether it yields or not.
+	 * a watchdog thread checks the workers while Run is running; 0 turns either off
+	 */
+	void SetTimeSlice(uint32_t sliceUs, uint32_t reportMs = 0, const std::string& loggerName = "default") {
+		m_sliceNs = (uint64_t)sliceUs * 1000;
+		m_longTaskNs = (uint64_t)reportMs * 1000000;
+		m_watchLogger = loggerName;
+	}
+
+	// true once the task on the calling worker used up its time slice
+	static bool SliceExpired() {
+		auto flag = t_preempt;
+		return flag && flag->load(std::memory_order_relaxed);
+	}
+
+	// true in the coroutine a worker resumed as its task; false in one that task
+	// created and resumes itself, which must not be requeued on its own
+	static bool InTask();
+
+	// the TaskGroup of the task on the calling worker, if any
+	static GroupState* CurrentGroup() {
+		return t_group;
+	}
+
+	static bool GroupCancelled() {
+		auto flag = t_cancelled;
+		return flag && flag->load(std::memory_order_relaxed);
+	}
+
+	// requeues the running task behind the queued ones, to threadNo's own queue if given.
+	// a no-op outside the worker's task coroutine
+	void Preempt(uint32_t threadNo = (uint32_t)-1);
+
+	SchedulerStats Stats();
+
+	void DumpStats();
+
 private:
-	util::Func GetFunc(uint32_t threadNo);
+	struct Task {
+		util::Func func;
+		uint32_t threadNo;
+		uint64_t enqueueNs;
+		CoroutinePtr co;	//resume instead of creating one from func
+		bool inlineRun;
+		bool background;
+		GroupState* group;	//the TaskGroup it was spawned into
+		uint64_t seq;	//order of arrival, whether or not stats are on
+	};
+
+	enum class Admit {
+		POLICY,
+		TRY,
+		ALWAYS,	//continuations of work already admitted
+	};
+
+
+	// written by its worker only, read by Stats(). a cache line of its own, so
+	// neighbouring workers' counters never share one
+	struct alignas(64) WorkerCounter : util::AlignedNew<WorkerCounter> {
+		std::atomic<uint64_t> executed{0};
+		std::atomic<uint64_t> pinned{0};
+		std::atomic<uint64_t> busyNs{0};
+		std::atomic<uint64_t> preempted{0};
+		std::atomic<uint64_t> longTasks{0};
+		util::AtomicHistogram waitNs;
+		util::AtomicHistogram runNs;
+
+		//the running slice, shared with the watchdog, which also writes it: on a line
+		//apart from the counters above so its checks do not pull theirs away
+		struct alignas(64) Slice {
+			std::atomic<uint64_t> start{0};	//0 between tasks
+			std::atomic<const std::type_info*> type{nullptr};
+			std::atomic<bool> preempt{false};
+			uint64_t reported = 0;	//watchdog only
+		} slice;
+
+		static void Bump(std::atomic<uint64_t>& c, uint64_t n) {
+			c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+	};
+
+	bool Push(util::Func&& func, uint32_t threadNo, CoroutinePtr co = nullptr, bool inlineRun = false,
+			Admit admit = Admit::POLICY, bool background = false, GroupState* group = nullptr);
+
+	//under mu
+	bool Full(uint32_t threadNo) const;
+
+	bool ShedOldest(uint32_t threadNo, util::Func& shed);
+
+	void TaskTaken(const Task& task);
+
+	// blocks while other work is still pending, false once all of it is done.
+	// without park it returns false instead of blocking
+	bool GetTask(uint32_t threadNo, Task& task, bool park = true);
+
+	void Done();
 
 	static void Main(Scheduler* self, uint32_t threadNo);
 
+	friend void RunBlocking(util::Func&& func);
+
+	// counted jobs were added to m_pending by ScheduleBlocking
+	void PushBlocking(util::Func&& func, bool counted);
+
+	static void BlockingMain(Scheduler* self, uint64_t id);
+
+	static void Watchdog(Scheduler* self);
+
+	static thread_local std::atomic<bool>* t_preempt;
+	//of the coroutine a worker is resuming
+	static thread_local Coroutine* t_task;
+	static thread_local GroupState* t_group;
+	static thread_local const std::atomic<bool>* t_cancelled;
+
 private:
-	std::list<std::pair<util::Func, uint32_t>> m_list;
+	//guarded by mu: Schedule goes to the shared queue, TSchedule and ScheduleCo with a
+	//thread to that worker's own, so taking a task never scans
+	std::deque<Task> m_shared;
+	std::vector<std::deque<Task>> m_local;
+	uint64_t m_queued = 0;
+	uint64_t m_seq = 0;
 	thread::Mutex mu;
+	thread::CondVar m_cond;
+	uint32_t m_idle = 0;
+	uint64_t m_stallNs = 1000000000;
+	bool m_stalled = false;	//guarded by mu
+	//scheduled tasks not finished yet, suspended coroutines included
+	std::atomic<uint64_t> m_pending{0};
 	const uint32_t m_threadNum;
 	const uint32_t m_maxThreadNo = (uint32_t)-1;
 	std::list<thread::ThreadPtr> m_threads;
+
+	//guarded by mu
+	uint64_t m_scheduled = 0;
+	uint64_t m_queueHighWater = 0;
+	std::vector<uint64_t> m_localHighWater;
+
+	//admission, guarded by mu. only fresh tasks count, resumed coroutines never wait
+	uint64_t m_capacity = 0;
+	uint64_t m_workerCapacity = 0;
+	Overflow m_overflow = Overflow::BLOCK;
+	uint64_t m_fresh = 0;
+	std::vector<uint64_t> m_localFresh;
+	bool m_running = false;
+	thread::CondVar m_spaceCond;
+	uint32_t m_spaceWaiters = 0;
+	std::deque<CoroutinePtr> m_coWaiters;
+	uint64_t m_rejected = 0;
+	uint64_t m_shed = 0;
+	uint64_t m_blocked = 0;
+	uint64_t m_cancelled = 0;
+
+	std::vector<std::unique_ptr<WorkerCounter>> m_counters;
+	struct BlockingJob {
+		util::Func func;
+		bool counted;
+	};
+
+	//the blocking pool, guarded by m_blockMu
+	thread::Mutex m_blockMu;
+	thread::CondVar m_blockCond;
+	thread::CondVar m_blockExitCond;
+	std::deque<BlockingJob> m_blockQueue;
+	std::map<uint64_t, thread::ThreadPtr> m_blockThreads;
+	std::vector<thread::ThreadPtr> m_blockExited;	//returned, not joined yet
+	uint64_t m_blockNextId = 0;
+	uint32_t m_blockIdle = 0;
+	uint32_t m_blockPeak = 0;
+	uint64_t m_blockRun = 0;
+	std::atomic<uint64_t> m_blockBusy{0};	//jobs queued or running, their coroutines may come back
+	bool m_blockStop = false;
+	uint32_t m_blockMax = 64;
+	uint64_t m_blockIdleNs = 10000000000ull;
+
+	uint64_t m_sliceNs = 0;
+	uint64_t m_longTaskNs = 0;
+	std::string m_watchLogger = "default";
+	thread::Mutex m_watchMu;
+	thread::CondVar m_watchCond;
+	bool m_watchStop = false;	//guarded by m_watchMu
+
+	std::atomic<bool> m_statsEnabled{true};
+	uint64_t m_startNs = util::NowNs();
+	uint64_t m_dumpIntervalNs = 0;
+	uint64_t m_lastDumpNs = 0;
+	std::string m_dumpLogger = "default";
 };
 
+// true once the TaskGroup of the running task was cancelled, see group.h
+inline bool CheckCancelled() {
+	return Scheduler::GroupCancelled();
+}
+
+// a checkpoint for long loops: yields once the slice is used up. false when the
+// task was cancelled and should return. costs two loads until either happens.
+// the task may continue on another worker, so never call it holding a thread lock
+inline bool MaybeYield() {
+	if (Scheduler::SliceExpired()) {
+		Scheduler::Current()->Preempt();
+	}
+	return !Scheduler::GroupCancelled();
+}
+
+/*
+ * from a coroutine on a Scheduler worker: hands func to the blocking pool and
+ * suspends until it returned, then continues on whichever worker is free. the
+ * worker runs other tasks meanwhile. anywhere else, a coroutine the task resumes
+ * itself included, func simply runs
+ */
+void RunBlocking(util::Func&& func);
+
+template<class F, class... ArgList>
+void RunBlocking(F&& f, ArgList&&... argList) {
+	RunBlocking(util::CreateFunc(std::forward<F>(f), std::forward<ArgList>(argList)...));
+}
+
 }
 
 }
@@ -0,0 +1,385 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#ifdef QF_ZLIB
+#include <zlib.h>
+#endif
+
+#include "segment.h"
+
+namespace qf
+{
+namespace log
+{
+
+class NoneCodec : public Codec
+{
+public:
+	virtual uint8_t Id() const override {
+		return 0;
+	}
+
+	virtual const char* Name() const override {
+		return "none";
+	}
+
+	virtual bool Compress(const char* data, size_t len, std::string& out) override {
+		out.append(data, len);
+		return true;
+	}
+
+	virtual bool Decompress(const char* data, size_t len, size_t rawLen, std::string& out) override {
+		if (len != rawLen) {
+			return false;
+		}
+		out.append(data, len);
+		return true;
+	}
+};
+
+#ifdef QF_ZLIB
+class ZlibCodec : public Codec
+{
+public:
+	virtual uint8_t Id() const override {
+		return 1;
+	}
+
+	virtual const char* Name() const override {
+		return "zlib";
+	}
+
+	//fastest level: log text still shrinks several times, and the writer thread keeps up
+	virtual bool Compress(const char* data, size_t len, std::string& out) override {
+		size_t base = out.size();
+		uLongf n = compressBound(len);
+		out.resize(base + n);
+		if (compress2((Bytef*)&out[base], &n, (const Bytef*)data, len, 1) != Z_OK) {
+			out.resize(base);
+			return false;
+		}
+		out.resize(base + n);
+		return true;
+	}
+
+	virtual bool Decompress(const char* data, size_t len, size_t rawLen, std::string& out) override {
+		size_t base = out.size();
+		uLongf n = rawLen;
+		out.resize(base + rawLen);
+		if (uncompress((Bytef*)&out[base], &n, (const Bytef*)data, len) != Z_OK || n != rawLen) {
+			out.resize(base);
+			return false;
+		}
+		return true;
+	}
+};
+#endif
+
+struct CodecRegistry
+{
+	thread::Mutex mu;
+	std::vector<CodecPtr> codecs;
+
+	CodecRegistry() {
+		codecs.push_back(std::make_shared<NoneCodec>());
+#ifdef QF_ZLIB
+		codecs.push_back(std::make_shared<ZlibCodec>());
+#endif
+	}
+};
+
+static CodecRegistry& Codecs() {
+	static CodecRegistry registry;
+	return registry;
+}
+
+void RegisterCodec(CodecPtr codec) {
+	auto& registry = Codecs();
+	thread::LockGuard<thread::Mutex> lock(registry.mu);
+	registry.codecs.insert(registry.codecs.begin(), codec);
+}
+
+CodecPtr GetCodec(const std::string& name) {
+	auto& registry = Codecs();
+	thread::LockGuard<thread::Mutex> lock(registry.mu);
+	for (auto& codec : registry.codecs) {
+		if (name == codec->Name()) {
+			return codec;
+		}
+	}
+	return nullptr;
+}
+
+CodecPtr GetCodec(uint8_t id) {
+	auto& registry = Codecs();
+	thread::LockGuard<thread::Mutex> lock(registry.mu);
+	for (auto& codec : registry.codecs) {
+		if (codec->Id() == id) {
+			return codec;
+		}
+	}
+	return nullptr;
+}
+
+static uint32_t s_crcTable[256];
+
+static bool InitCrcTable() {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		}
+		s_crcTable[i] = c;
+	}
+	return true;
+}
+
+uint32_t Crc32(uint32_t crc, const char* data, size_t len) {
+	static bool init = InitCrcTable();
+	(void)init;
+	crc = ~crc;
+	for (size_t i = 0; i < len; i++) {
+		crc = s_crcTable[(crc ^ (uint8_t)data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static uint32_t FrameCrc(const FrameHeader& header, const char* data, size_t len) {
+	return Crc32(Crc32(0, (const char*)&header, offsetof(FrameHeader, crc)), data, len);
+}
+
+static void WriteAll(int fd, const char* buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+SegmentWriter::SegmentWriter(const LogFormaterPtr formater, const std::string& name, const std::string& codec,
+		uint32_t frameBytes, uint32_t flushMs)
+	: LogWriter(formater)
+	, m_fileName(name)
+	, m_frameBytes(frameBytes ? frameBytes : 1)
+	, m_flushNs((uint64_t)(flushMs ? flushMs : 1) * 1000000) {
+	m_codec = GetCodec(codec);
+	if (!m_codec) {
+		m_codec = GetCodec("none");
+	}
+	m_fd = open(m_fileName.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	m_text.reserve(m_frameBytes + 1024);
+	m_thread = thread::CreateThread(&Main, this);
+	m_thread->Run();
+}
+
+SegmentWriter::~SegmentWriter() {
+	{
+		thread::LockGuard<thread::Mutex> lock(m_mu);
+		Seal();
+		m_stop = true;
+		m_cond.Signal();
+	}
+	m_thread->Join();
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+}
+
+void SegmentWriter::Seal() {
+	if (m_lines == 0) {
+		return;
+	}
+	m_sealed.push_back(Frame{ std::move(m_text), m_lines });
+	m_text = std::string();
+	m_text.reserve(m_frameBytes + 1024);
+	m_lines = 0;
+}
+
+void SegmentWriter::Output(LogEventPtr event) {
+	auto logString = m_formater->GenLogString(event);
+	thread::LockGuard<thread::Mutex> lock(m_mu);
+	m_text.append(logString);
+	m_text.push_back('\n');
+	m_lines++;
+	m_rawBytes += logString.size() + 1;
+	if (m_text.size() >= m_frameBytes) {
+		//keep memory bounded when the disk or the codec falls behind
+		while (m_sealed.size() >= maxPending) {
+			m_doneCond.Wait(m_mu);
+		}
+		Seal();
+		m_cond.Signal();
+	}
+}
+
+void SegmentWriter::Flush() {
+	thread::LockGuard<thread::Mutex> lock(m_mu);
+	Seal();
+	m_cond.Signal();
+	while (!m_sealed.empty() || m_writing) {
+		m_doneCond.Wait(m_mu);
+	}
+}
+
+uint64_t SegmentWriter::RawBytes() {
+	thread::LockGuard<thread::Mutex> lock(m_mu);
+	return m_rawBytes;
+}
+
+uint64_t SegmentWriter::FileBytes() {
+	thread::LockGuard<thread::Mutex> lock(m_mu);
+	return m_fileBytes;
+}
+
+void SegmentWriter::WriteFrame(const Frame& frame, std::string& out) {
+	out.resize(sizeof(FrameHeader));
+	FrameHeader header;
+	header.frameMagic = FrameHeader::magic;
+	header.codec = m_codec->Id();
+	header.version = 1;
+	header.reserved = 0;
+	header.lines = frame.lines;
+	header.rawLen = (uint32_t)frame.text.size();
+	if (!m_codec->Compress(frame.text.data(), frame.text.size(), out)) {
+		//stored as is rather than lost
+		out.resize(sizeof(FrameHeader));
+		out.append(frame.text);
+		header.codec = 0;
+	}
+	header.dataLen = (uint32_t)(out.size() - sizeof(FrameHeader));
+	header.crc = FrameCrc(header, out.data() + sizeof(FrameHeader), header.dataLen);
+	memcpy(&out[0], &header, sizeof(header));
+	//one write per frame: with O_APPEND a frame is never interleaved
+	WriteAll(m_fd, out.data(), out.size());
+}
+
+void SegmentWriter::Main(SegmentWriter* self) {
+	std::string out;
+	auto& mu = self->m_mu;
+	mu.Lock();
+	while (true) {
+		if (self->m_sealed.empty()) {
+			if (self->m_stop) {
+				break;
+			}
+			//a partial frame goes out once it waited flushMs
+			if (!self->m_cond.TimedWait(mu, self->m_flushNs) && self->m_sealed.empty()) {
+				self->Seal();
+			}
+			continue;
+		}
+		auto frame = std::move(self->m_sealed.front());
+		self->m_sealed.pop_front();
+		self->m_writing = true;
+		mu.Unlock();
+		if (self->m_fd >= 0) {
+			self->WriteFrame(frame, out);
+		}
+		mu.Lock();
+		self->m_writing = false;
+		self->m_fileBytes += self->m_fd >= 0 ? out.size() : 0;
+		self->m_doneCond.Broadcast();
+	}
+	mu.Unlock();
+}
+
+SegmentReader::SegmentReader(const std::string& fileName) {
+	m_fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (m_fd >= 0 && fstat(m_fd, &st) == 0) {
+		m_size = st.st_size;
+	}
+}
+
+SegmentReader::~SegmentReader() {
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+}
+
+static bool ReadAt(int fd, void* buf, size_t len, uint64_t offset) {
+	char* p = (char*)buf;
+	while (len > 0) {
+		ssize_t n = pread(fd, p, len, offset);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		p += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+bool SegmentReader::ReadFrame(uint64_t offset, FrameHeader& header, std::string& data) {
+	if (offset + sizeof(header) > m_size || !ReadAt(m_fd, &header, sizeof(header), offset)) {
+		return false;
+	}
+	if (header.frameMagic != FrameHeader::magic || offset + sizeof(header) + header.dataLen > m_size) {
+		return false;
+	}
+	data.resize(header.dataLen);
+	if (!ReadAt(m_fd, &data[0], header.dataLen, offset + sizeof(header))) {
+		return false;
+	}
+	return FrameCrc(header, data.data(), data.size()) == header.crc;
+}
+
+void Logger::AddSegmentWriter(const std::string& name, const std::string& codec, uint32_t frameBytes) {
+	AddWriter(name, std::make_shared<SegmentWriter>(m_formater, name, codec, frameBytes));
+}
+
+bool SegmentReader::Next(std::string& text) {
+	if (m_fd < 0) {
+		return false;
+	}
+	FrameHeader header;
+	std::string data;
+	std::string window;
+	while (m_offset + sizeof(header) <= m_size) {
+		if (ReadFrame(m_offset, header, data)) {
+			auto codec = GetCodec(header.codec);
+			text.clear();
+			if (codec && codec->Decompress(data.data(), data.size(), header.rawLen, text)) {
+				m_frameOffset = m_offset;
+				m_frameLines = header.lines;
+				m_offset += sizeof(header) + header.dataLen;
+				return true;
+			}
+		}
+		//not a frame here: resync on the next magic
+		uint64_t from = m_offset + 1;
+		uint64_t len = std::min<uint64_t>(64 * 1024, m_size - std::min(from, m_size));
+		window.resize(len);
+		if (len < sizeof(uint32_t) || !ReadAt(m_fd, &window[0], len, from)) {
+			m_offset = m_size;
+			break;
+		}
+		const uint32_t magic = FrameHeader::magic;
+		auto pos = window.find(std::string((const char*)&magic, sizeof(magic)), 0);
+		if (pos == std::string::npos) {
+			//the magic may straddle the window end
+			m_offset = from + len - (sizeof(magic) - 1) - 1;
+		} else {
+			m_offset = from + pos;
+		}
+	}
+	return false;
+}
+
+}
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <stdint.h>
+#include <string>
+
+#include "log.h"
+#include "thread.h"
+
+namespace qf
+{
+namespace log
+{
+
+/*
+ * a compression plugin for SegmentWriter. a codec is shared by every writer
+ * and reader using it, so Compress and Decompress must not keep state between calls.
+ * ids go into each frame header: 0 none, 1 zlib, 2 lz4 and 3 zstd are taken
+ */
+class Codec
+{
+public:
+	virtual ~Codec() {
+
+	}
+
+	virtual uint8_t Id() const = 0;
+
+	virtual const char* Name() const = 0;
+
+	// appends the compressed data to out
+	virtual bool Compress(const char* data, size_t len, std::string& out) = 0;
+
+	// appends exactly rawLen bytes to out, false on corrupt input
+	virtual bool Decompress(const char* data, size_t len, size_t rawLen, std::string& out) = 0;
+};
+
+typedef std::shared_ptr<Codec> CodecPtr;
+
+// "none" is always there, "zlib" when built with zlib. a later codec with the same id or name wins
+void RegisterCodec(CodecPtr codec);
+
+CodecPtr GetCodec(const std::string& name);
+
+CodecPtr GetCodec(uint8_t id);
+
+/*
+ * a segment file is a run of self-delimiting frames, each one compressed on its
+ * own: header, then dataLen bytes. crc covers the header fields before it and
+ * the data, so a frame torn by a crash is told apart from the ones before it
+ */
+struct FrameHeader
+{
+	static constexpr uint32_t magic = 0x5a4c4651;	//"QFLZ"
+
+	uint32_t frameMagic;
+	uint8_t codec;
+	uint8_t version;
+	uint16_t reserved;
+	uint32_t lines;
+	uint32_t rawLen;
+	uint32_t dataLen;
+	uint32_t crc;
+};
+
+static_assert(sizeof(FrameHeader) == 24, "frame header layout");
+
+uint32_t Crc32(uint32_t crc, const char* data, size_t len);
+
+/*
+ * writes log lines as compressed frames. Output only appends to the frame being
+ * filled; full frames are compressed and appended by a background thread, and a
+ * partial one after flushMs. a crash loses the frames not written yet, never the
+ * ones before them. Output blocks while maxPending frames wait for the thread.
+ * an unknown codec name falls back to "none"
+ */
+class SegmentWriter : public LogWriter
+{
+public:
+	SegmentWriter(const LogFormaterPtr formater, const std::string& name, const std::string& codec = "zlib",
+			uint32_t frameBytes = 256 * 1024, uint32_t flushMs = 1000);
+
+	~SegmentWriter();
+
+	virtual void Output(LogEventPtr event) override;
+
+	// returns once everything logged before it is in the file
+	virtual void Flush() override;
+
+	const std::string& FileName() const {
+		return m_fileName;
+	}
+
+	// log text taken and file bytes written so far
+	uint64_t RawBytes();
+
+	uint64_t FileBytes();
+
+private:
+	struct Frame {
+		std::string text;
+		uint32_t lines;
+	};
+
+	static void Main(SegmentWriter* self);
+
+	void WriteFrame(const Frame& frame, std::string& out);
+
+	//under m_mu
+	void Seal();
+
+private:
+	static constexpr size_t maxPending = 4;
+
+	std::string m_fileName;
+	int m_fd = -1;
+	CodecPtr m_codec;
+	uint32_t m_frameBytes;
+	uint64_t m_flushNs;
+
+	//guarded by m_mu
+	thread::Mutex m_mu;
+	thread::CondVar m_cond;	//to the thread: frames sealed, or stop
+	thread::CondVar m_doneCond;	//from the thread: frames written
+	std::string m_text;
+	uint32_t m_lines = 0;
+	std::deque<Frame> m_sealed;
+	bool m_writing = false;
+	bool m_stop = false;
+	uint64_t m_rawBytes = 0;
+	uint64_t m_fileBytes = 0;
+
+	thread::ThreadPtr m_thread;
+};
+
+/*
+ * reads a segment file back frame by frame. a frame that fails its checks is
+ * skipped up to the next intact one, so reading starts anywhere with Seek and a
+ * torn tail just ends the file
+ */
+class SegmentReader
+{
+public:
+	SegmentReader(const std::string& fileName);
+
+	~SegmentReader();
+
+	bool Ok() const {
+		return m_fd >= 0;
+	}
+
+	// the text of the next intact frame, false at the end
+	bool Next(std::string& text);
+
+	// continues from the first intact frame starting at or after offset
+	void Seek(uint64_t offset) {
+		m_offset = offset;
+	}
+
+	// where the frame Next returned last started
+	uint64_t FrameOffset() const {
+		return m_frameOffset;
+	}
+
+	uint32_t FrameLines() const {
+		return m_frameLines;
+	}
+
+private:
+	// reads and checks the frame at offset
+	bool ReadFrame(uint64_t offset, FrameHeader& header, std::string& data);
+
+private:
+	int m_fd = -1;
+	uint64_t m_size = 0;
+	uint64_t m_offset = 0;
+	uint64_t m_frameOffset = 0;
+	uint32_t m_frameLines = 0;
+};
+
+}
+}
@@ -0,0 +1,327 @@
+#pragma once
+
+/*
+ * stackless tasks on C++20 coroutines, built only in the QF_CXX20 mode.
+ * a Task is lazy: it starts when awaited, Spawned or Awaited from a stackful coroutine.
+ * a frame only holds the locals that live across co_await, instead of a whole stack
+ */
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include <assert.h>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "coroutine.h"
+#include "lock.h"
+#include "scheduler.h"
+#include "util.h"
+
+namespace qf {
+namespace co {
+
+template<class T>
+class Task;
+
+class TaskPromiseBase {
+public:
+	struct FinalAwaiter {
+		bool await_ready() noexcept {
+			return false;
+		}
+
+		//the frame may be gone once onDone ran, nothing touches it afterwards
+		template<class P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+			auto& promise = h.promise();
+			if (promise.m_continuation) {
+				return promise.m_continuation;
+			}
+			if (promise.m_onDone) {
+				auto onDone = std::move(promise.m_onDone);
+				onDone();
+			}
+			return std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {
+
+		}
+	};
+
+	std::suspend_always initial_suspend() noexcept {
+		return {};
+	}
+
+	FinalAwaiter final_suspend() noexcept {
+		return {};
+	}
+
+	void unhandled_exception() {
+		std::terminate();
+	}
+
+	// resumed in place, on the same thread, when the task finishes
+	void SetContinuation(std::coroutine_handle<> h) {
+		m_continuation = h;
+	}
+
+	// called when the task finishes and nobody awaits it
+	void SetOnDone(util::Func&& f) {
+		m_onDone = std::move(f);
+	}
+
+private:
+	std::coroutine_handle<> m_continuation;
+	util::Func m_onDone;
+};
+
+template<class T>
+class TaskPromise : public TaskPromiseBase {
+public:
+	Task<T> get_return_object() noexcept;
+
+	template<class V>
+	void return_value(V&& v) {
+		m_value.emplace(std::forward<V>(v));
+	}
+
+	T Result() {
+		return std::move(*m_value);
+	}
+
+private:
+	std::optional<T> m_value;
+};
+
+template<>
+class TaskPromise<void> : public TaskPromiseBase {
+public:
+	Task<void> get_return_object() noexcept;
+
+	void return_void() {
+
+	}
+
+	void Result() {
+
+	}
+};
+
+template<class T = void>
+class Task {
+public:
+	typedef TaskPromise<T> promise_type;
+	typedef std::coroutine_handle<promise_type> Handle;
+
+	Task() {
+
+	}
+
+	explicit Task(Handle h)
+		: m_h(h) {
+
+	}
+
+	Task(Task&& other) noexcept
+		: m_h(std::exchange(other.m_h, {})) {
+
+	}
+
+	Task& operator=(Task&& other) noexcept {
+		if (this != &other) {
+			if (m_h) {
+				m_h.destroy();
+			}
+			m_h = std::exchange(other.m_h, {});
+		}
+		return *this;
+	}
+
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	~Task() {
+		if (m_h) {
+			m_h.destroy();
+		}
+	}
+
+	bool Done() const {
+		return !m_h || m_h.done();
+	}
+
+	Handle GetHandle() const {
+		return m_h;
+	}
+
+	// the caller owns the frame from now on
+	Handle Release() {
+		return std::exchange(m_h, {});
+	}
+
+	// co_await task starts it and continues the awaiter right where it finishes
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+		m_h.promise().SetContinuation(awaiting);
+		return m_h;
+	}
+
+	T await_resume() {
+		return m_h.promise().Result();
+	}
+
+private:
+	Handle m_h;
+};
+
+template<class T>
+inline Task<T> TaskPromise<T>::get_return_object() noexcept {
+	return Task<T>(Task<T>::Handle::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept {
+	return Task<void>(Task<void>::Handle::from_promise(*this));
+}
+
+// co_await Reschedule(): queue the task on the scheduler and continue on whichever worker picks it up
+class RescheduleAwaiter {
+public:
+	explicit RescheduleAwaiter(Scheduler* sc)
+		: m_sc(sc ? sc : Scheduler::Current()) {
+		assert(m_sc);
+	}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	void await_suspend(std::coroutine_handle<> h) {
+		m_sc->ScheduleInline([h]() {
+			h.resume();
+		});
+	}
+
+	void await_resume() const noexcept {
+
+	}
+
+private:
+	Scheduler* m_sc;
+};
+
+inline RescheduleAwaiter Reschedule(Scheduler* sc = nullptr) {
+	return RescheduleAwaiter(sc);
+}
+
+// runs a detached task on sc, its frame is freed when it finishes
+inline void Spawn(Scheduler& sc, Task<void>&& task) {
+	auto h = task.Release();
+	h.promise().SetOnDone(util::CreateFunc([h]() {
+		h.destroy();
+	}));
+	sc.ScheduleInline([h]() {
+		h.resume();
+	});
+}
+
+/*
+ * stackful awaiting stackless: from a coroutine running on a Scheduler worker,
+ * suspends it until task is done; it continues on whichever worker is free then.
+ * anywhere else, a nested coroutine or a plain thread, the task starts right here
+ * and the thread waits if it went off to another worker
+ */
+template<class T>
+T Await(Task<T> task) {
+	auto h = task.GetHandle();
+	//nobody may requeue a coroutine its task resumes itself
+	if (!Scheduler::InTask()) {
+		auto done = std::make_shared<std::atomic<uint32_t>>(0);
+		h.promise().SetOnDone(util::CreateFunc([done]() {
+			done->store(1, std::memory_order_release);
+			thread::FutexWake(done.get(), 1);
+		}));
+		h.resume();
+		while (!done->load(std::memory_order_acquire)) {
+			thread::FutexWait(done.get(), 0);
+		}
+		return h.promise().Result();
+	}
+	auto sc = Scheduler::Current();
+	auto self = Running();
+	h.promise().SetOnDone(util::CreateFunc([sc, self]() {
+		sc->ScheduleCo(self);
+	}));
+	YieldWith(util::CreateFunc([sc, h]() {
+		sc->ScheduleInline([h]() {
+			h.resume();
+		});
+	}));
+	return h.promise().Result();
+}
+
+/*
+ * stackless awaiting stackful: co_await Stackful(f) runs f as an ordinary Schedule task,
+ * where it may Yield or Await, and continues the awaiter with its result
+ */
+template<class F, class R = std::invoke_result_t<F&>>
+class StackfulAwaiter {
+public:
+	StackfulAwaiter(F&& f, Scheduler* sc)
+		: m_f(std::move(f))
+		, m_sc(sc ? sc : Scheduler::Current()) {
+		assert(m_sc);
+	}
+
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	void await_suspend(std::coroutine_handle<> h) {
+		auto sc = m_sc;
+		auto result = &m_result;
+		//a continuation of admitted work, never refused or held back by SetCapacity
+		auto func = util::CreateFunc([sc, h, result, f = std::move(m_f)]() {
+			if constexpr (std::is_void<R>::value) {
+				f();
+				result->emplace(true);
+			} else {
+				result->emplace(f());
+			}
+			sc->ScheduleInline([h]() {
+				h.resume();
+			});
+		});
+		m_sc->ScheduleAdmitted(std::move(func));
+	}
+
+	R await_resume() {
+		if constexpr (!std::is_void<R>::value) {
+			return std::move(*m_result);
+		}
+	}
+
+private:
+	typedef typename std::conditional<std::is_void<R>::value, bool, R>::type Slot;
+
+	F m_f;
+	Scheduler* m_sc;
+	std::optional<Slot> m_result;
+};
+
+template<class F>
+StackfulAwaiter<typename std::decay<F>::type> Stackful(F&& f, Scheduler* sc = nullptr) {
+	return StackfulAwaiter<typename std::decay<F>::type>(typename std::decay<F>::type(std::forward<F>(f)), sc);
+}
+
+}
+
+}
+
+#endif
@@ -3,6 +3,7 @@
 #include <memory>
 #include <pthread.h>
 #include <atomic>
+#include "lock.h"
 #include "util.h"
 
 namespace qf {
@@ -22,14 +23,58 @@ public:
 		pthread_mutex_lock(&m);
 	}
 
+	bool TryLock() {
+		return pthread_mutex_trylock(&m) == 0;
+	}
+
 	void Unlock() {
 		pthread_mutex_unlock(&m);
 	}
 	
 private:
+	friend class CondVar;
 	pthread_mutex_t m;
 };
 
+class CondVar {
+public:
+	CondVar() {
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&c, &attr);
+		pthread_condattr_destroy(&attr);
+	}
+
+	~CondVar() {
+		pthread_cond_destroy(&c);
+	}
+
+	void Wait(Mutex& mu) {
+		pthread_cond_wait(&c, &mu.m);
+	}
+
+	// false on timeout
+	bool TimedWait(Mutex& mu, uint64_t timeoutNs) {
+		uint64_t deadline = util::NowNs() + timeoutNs;
+		struct timespec ts;
+		ts.tv_sec = deadline / 1000000000;
+		ts.tv_nsec = deadline % 1000000000;
+		return pthread_cond_timedwait(&c, &mu.m, &ts) == 0;
+	}
+
+	void Signal() {
+		pthread_cond_signal(&c);
+	}
+
+	void Broadcast() {
+		pthread_cond_broadcast(&c);
+	}
+
+private:
+	pthread_cond_t c;
+};
+
 template<class Mu>
 class LockGuard {
 public:
@@ -0,0 +1,192 @@
+#include <fstream>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#include "thread.h"
+#include "trace.h"
+
+namespace qf {
+namespace trace {
+
+std::atomic<bool> s_recording{false};
+thread_local Buffer* t_buffer = nullptr;
+
+static thread::Mutex s_mu;
+static std::vector<Buffer*> s_buffers;
+static std::vector<Buffer*> s_retired;	//of exited threads, reused once flushed
+static uint64_t s_baseTicks = 0;
+static uint64_t s_baseNs = 0;
+static std::string s_exitPath;
+
+//hands the thread's buffer back when it exits
+struct BufferGuard {
+	bool armed = false;
+
+	~BufferGuard();
+};
+
+static thread_local BufferGuard t_guard;
+static thread_local bool t_exited = false;
+
+BufferGuard::~BufferGuard() {
+	t_exited = true;
+	Buffer* buf = t_buffer;
+	t_buffer = nullptr;
+	if (buf) {
+		thread::LockGuard<thread::Mutex> lock(s_mu);
+		s_retired.push_back(buf);
+	}
+}
+
+Buffer* RegisterBuffer() {
+	//events recorded by the destructors running after the guard's are dropped
+	if (t_exited) {
+		return nullptr;
+	}
+	//its first use registers the destructor for this thread's exit
+	t_guard.armed = true;
+	uint32_t threadId = thread::GetThreadId();
+	Buffer* buf = nullptr;
+	{
+		thread::LockGuard<thread::Mutex> lock(s_mu);
+		for (auto iter = s_retired.begin(); iter != s_retired.end(); ++iter) {
+			if ((*iter)->flushed == (*iter)->head.load(std::memory_order_relaxed)) {
+				buf = *iter;
+				s_retired.erase(iter);
+				break;
+			}
+		}
+		if (buf) {
+			buf->head.store(0, std::memory_order_relaxed);
+			buf->flushed = 0;
+		} else {
+			buf = new Buffer;
+			s_buffers.push_back(buf);
+		}
+		buf->threadId = threadId;
+	}
+	t_buffer = buf;
+	return buf;
+}
+
+void Start() {
+	{
+		thread::LockGuard<thread::Mutex> lock(s_mu);
+		if (!s_baseNs) {
+			s_baseTicks = util::ReadTicks();
+			s_baseNs = util::NowNs();
+		}
+	}
+	s_recording.store(true, std::memory_order_relaxed);
+}
+
+void Stop() {
+	s_recording.store(false, std::memory_order_relaxed);
+}
+
+static const char* EventName(EventType type) {
+	switch (type) {
+	case EventType::CO_CREATE:
+		return "create";
+	case EventType::CO_YIELD:
+		return "yield";
+	case EventType::CO_DEAD:
+		return "dead";
+	case EventType::TASK_DEQUEUE:
+		return "dequeue";
+	case EventType::PARK:
+		return "park";
+	case EventType::UNPARK:
+		return "unpark";
+	default:
+		break;
+	}
+	return "unknown";
+}
+
+bool Flush(const std::string& path) {
+	std::ofstream ofs(path, std::ios::out | std::ios::trunc);
+	if (!ofs.is_open()) {
+		return false;
+	}
+
+	thread::LockGuard<thread::Mutex> lock(s_mu);
+	double nsPerTick = 1.0;
+	uint64_t ticks = util::ReadTicks();
+	uint64_t ns = util::NowNs();
+	if (ticks > s_baseTicks && s_baseNs) {
+		nsPerTick = (double)(ns - s_baseNs) / (double)(ticks - s_baseTicks);
+	}
+
+	int pid = getpid();
+	bool first = true;
+	auto sep = [&]() -> std::ofstream& {
+		ofs << (first ? "\n" : ",\n");
+		first = false;
+		return ofs;
+	};
+
+	ofs << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	for (auto buf : s_buffers) {
+		sep() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << buf->threadId
+			<< ",\"args\":{\"name\":\"thread_" << buf->threadId << "\"}}";
+
+		uint64_t head = buf->head.load(std::memory_order_acquire);
+		uint64_t begin = head > Buffer::capacity ? head - Buffer::capacity : 0;
+		int depth = 0;
+		for (uint64_t i = begin; i < head; i++) {
+			const Event& ev = buf->events[i & (Buffer::capacity - 1)];
+			if (ev.ticks < s_baseTicks) {
+				continue;
+			}
+			double us = (double)(ev.ticks - s_baseTicks) * nsPerTick / 1000.0;
+			std::string common = ",\"ts\":" + std::to_string(us) + ",\"pid\":" + std::to_string(pid)
+				+ ",\"tid\":" + std::to_string(buf->threadId);
+			switch (ev.type) {
+			case EventType::CO_RESUME:
+				depth++;
+				sep() << "{\"name\":\"co " << ev.arg << "\",\"ph\":\"B\"" << common << "}";
+				break;
+			case EventType::CO_RESUME_END:
+				//the matching begin was overwritten by the ring
+				if (depth == 0) {
+					break;
+				}
+				depth--;
+				sep() << "{\"ph\":\"E\"" << common << "}";
+				break;
+			default:
+				sep() << "{\"name\":\"" << EventName(ev.type) << "\",\"ph\":\"i\",\"s\":\"t\"" << common
+					<< ",\"args\":{\"arg\":" << ev.arg << "}}";
+				break;
+			}
+		}
+		buf->flushed = head;
+	}
+	ofs << "\n]}\n";
+	return ofs.good();
+}
+
+static void FlushExit() {
+	Stop();
+	Flush(s_exitPath);
+}
+
+size_t BufferNum() {
+	thread::LockGuard<thread::Mutex> lock(s_mu);
+	return s_buffers.size();
+}
+
+void FlushAtExit(const std::string& path) {
+	bool registered = !s_exitPath.empty();
+	s_exitPath = path;
+	if (!registered) {
+		atexit(&FlushExit);
+	}
+	Start();
+}
+
+}
+
+}
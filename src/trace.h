@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+#include "util.h"
+
+namespace qf {
+namespace trace {
+
+enum class EventType : uint32_t {
+	CO_CREATE = 0,
+	CO_RESUME = 1,		//begin of a Resume slice
+	CO_RESUME_END = 2,	//Resume returned to the resumer
+	CO_YIELD = 3,
+	CO_DEAD = 4,
+	TASK_DEQUEUE = 5,
+	PARK = 6,
+	UNPARK = 7,
+};
+
+struct Event {
+	uint64_t ticks;
+	int64_t arg;
+	EventType type;
+};
+
+// one per thread, written by its owner only. old events are overwritten when full.
+// when the thread exits the buffer waits for a Flush, then a new thread may take it over
+struct Buffer {
+	static constexpr uint64_t capacity = 1 << 16;
+
+	Event events[capacity];
+	std::atomic<uint64_t> head{0};
+	uint32_t threadId = 0;
+	uint64_t flushed = 0;	//head when last flushed
+};
+
+extern std::atomic<bool> s_recording;
+extern thread_local Buffer* t_buffer;
+
+// nullptr once the thread is exiting
+Buffer* RegisterBuffer();
+
+inline bool Recording() {
+	return s_recording.load(std::memory_order_relaxed);
+}
+
+inline void Record(EventType type, int64_t arg) {
+	Buffer* buf = t_buffer;
+	if (!buf) {
+		buf = RegisterBuffer();
+		if (!buf) {
+			return;
+		}
+	}
+	uint64_t h = buf->head.load(std::memory_order_relaxed);
+	Event& ev = buf->events[h & (Buffer::capacity - 1)];
+	ev.ticks = util::ReadTicks();
+	ev.arg = arg;
+	ev.type = type;
+	buf->head.store(h + 1, std::memory_order_release);
+}
+
+void Start();
+
+void Stop();
+
+// writes chrome trace_event json, viewable in chrome://tracing or perfetto.
+// meant to be called when workers are quiet; events written meanwhile may be torn
+bool Flush(const std::string& path);
+
+// Start now and Flush to path when the process exits
+void FlushAtExit(const std::string& path);
+
+// buffers allocated so far, the ones taken over by new threads count once
+size_t BufferNum();
+
+}
+
+}
+
+#ifdef QF_TRACE_ENABLED
+#define QF_TRACE(type, arg) \
+	do { \
+		if (qf::trace::Recording()) { \
+			qf::trace::Record(qf::trace::EventType::type, (int64_t)(arg)); \
+		} \
+	} while (0)
+#else
+#define QF_TRACE(type, arg) do {} while (0)
+#endif
@@ -1,10 +1,75 @@
 #pragma once
 
+#include <cxxabi.h>
 #include <memory>
+#include <new>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <time.h>
+#include <type_traits>
+#include <typeinfo>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 namespace util
 {
 
+inline uint64_t NowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// clock tick resolution (a few ms) at a fraction of NowNs' cost, for rate limits and the like
+inline uint64_t CoarseNowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// tsc where available, otherwise NowNs. callers convert against two NowNs samples
+inline uint64_t ReadTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return NowNs();
+#endif
+}
+
+// demangled, for reports that name a task by the type of its callable
+inline std::string Demangle(const char* symbol) {
+	int status = 0;
+	char* demangled = abi::__cxa_demangle(symbol, nullptr, nullptr, &status);
+	std::string name = status == 0 ? demangled : symbol;
+	free(demangled);
+	return name;
+}
+
+inline std::string TypeName(const std::type_info* type) {
+	if (!type) {
+		return "unknown";
+	}
+	return Demangle(type->name());
+}
+
+// a base for heap objects whose alignas must hold: plain new only aligns to 16 before C++17
+template<class T>
+struct AlignedNew {
+	static void* operator new(size_t size) {
+		void* p = nullptr;
+		if (posix_memalign(&p, alignof(T), size)) {
+			throw std::bad_alloc();
+		}
+		return p;
+	}
+
+	static void operator delete(void* p) {
+		free(p);
+	}
+};
+
 template<class T> std::shared_ptr<T> GetInstance() {
 	static std::shared_ptr<T> ptr = std::make_shared<T>();
 	return ptr;
@@ -72,6 +137,9 @@ public:
 	virtual ~FuncBase() {
 
 	}
+
+	const std::type_info* type = nullptr;	//of the callable CreateFunc was given
+	const void* addr = nullptr;	//of the function, when that callable is a plain function pointer
 };
 
 typedef std::shared_ptr<FuncBase> FuncBasePtr;
@@ -115,10 +183,26 @@ public:
 		return _func == nullptr;
 	}
 
-	void operator()() {
+	void operator()() const {
 		_func->ExecuteFunc();
 	}
 
+	const std::type_info* Type() const {
+		return _func ? _func->type : nullptr;
+	}
+
+	const void* Address() const {
+		return _func ? _func->addr : nullptr;
+	}
+
+	// for wrappers that stand in for another callable
+	void SetType(const std::type_info* type, const void* addr = nullptr) {
+		if (_func) {
+			_func->type = type;
+			_func->addr = addr;
+		}
+	}
+
 private:
 	FuncBasePtr _func;
 };
@@ -128,16 +212,32 @@ void UnpackArgCall(F&& f, Args&& args, std::index_sequence<N...>) {
 	f(std::get<N>(args)...);
 }
 
+template<class F>
+const void* FuncAddress(const F& f, std::true_type) {
+	return reinterpret_cast<const void*>(f);
+}
+
+template<class F>
+const void* FuncAddress(const F&, std::false_type) {
+	return nullptr;
+}
+
 template<class F, class... ArgList>
 Func CreateFunc(F&& f, ArgList&&... argList) {
+	typedef typename std::decay<F>::type Callable;
+	std::integral_constant<bool, std::is_pointer<Callable>::value
+			&& std::is_function<typename std::remove_pointer<Callable>::type>::value> plain;
+	const void* addr = FuncAddress<Callable>(f, plain);
 	//注意这里make_tuple是传值 而非引用
 	auto args = std::make_tuple(std::forward<ArgList>(argList)...);
 	auto wrapper = [f = std::forward<F>(f), args = std::move(args)]() {
 		constexpr size_t n = sizeof... (ArgList);
 		UnpackArgCall(f, args, std::make_index_sequence<n>{});
 	};
-	return Func { std::make_shared<FuncImpl<typename std::decay<decltype(wrapper)>::type>>(
+	Func func { std::make_shared<FuncImpl<typename std::decay<decltype(wrapper)>::type>>(
 			std::move(wrapper)) };
+	func.SetType(&typeid(Callable), addr);
+	return func;
 }
 
 }
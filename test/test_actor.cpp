@@ -0,0 +1,132 @@
+#include "actor.h"
+#include "log.h"
+#include "scheduler.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <vector>
+
+using namespace qf;
+
+static auto logger = GetLogger();
+
+static const int producers = 4;
+static const int perKey = 20;
+
+//per key: the next sequence number expected from each producer, and a flag for overlap
+struct KeyState {
+	int next[producers] = { 0 };
+	std::atomic<bool> running{false};
+};
+
+static std::vector<KeyState>* states;
+static std::atomic<long> handled{0};
+
+void handle(uint64_t key, int producer, int seq) {
+	auto& state = (*states)[key];
+	bool overlap = state.running.exchange(true);
+	assert(!overlap);
+	assert(state.next[producer] == seq);
+	state.next[producer]++;
+	//a handler may suspend, the key's next message waits for it
+	if (seq % 7 == 0) {
+		auto sc = co::Scheduler::Current();
+		auto self = co::Running();
+		co::YieldWith(util::CreateFunc([sc, self]() {
+			sc->ScheduleCo(self);
+		}));
+	}
+	state.running.store(false);
+	handled++;
+}
+
+void test_order(int keys) {
+	std::vector<KeyState> s(keys);
+	states = &s;
+	handled = 0;
+	co::Scheduler sc(4);
+	co::ActorSystem actors(sc);
+	for (int p = 0; p < producers; p++) {
+		sc.Schedule([&actors, keys, p]() {
+			for (int seq = 0; seq < perKey; seq++) {
+				for (int key = 0; key < keys; key++) {
+					actors.Send(key, &handle, key, p, seq);
+				}
+				if (seq == perKey / 2) {
+					actors.Rebalance();
+				}
+			}
+		});
+	}
+	//moves a partition back and forth while its keys are busy
+	sc.Schedule([&actors]() {
+		for (int i = 0; i < 1000; i++) {
+			actors.Rebalance(0, i);
+			co::Scheduler::Current()->Schedule([]() {});
+		}
+	});
+	sc.Run();
+	assert(handled == (long)keys * producers * perKey);
+	for (auto& state : s) {
+		for (int p = 0; p < producers; p++) {
+			assert(state.next[p] == perKey);
+		}
+	}
+	assert(actors.ActiveKeys() == 0);
+}
+
+static std::vector<pthread_t> drainers;
+
+//spins past the slice, so the drain is preempted between messages
+void spin(uint64_t key) {
+	auto& drainer = drainers[key];
+	assert(drainer == pthread_t() || pthread_equal(drainer, pthread_self()));
+	drainer = pthread_self();
+	uint64_t end = util::NowNs() + 500000;
+	while (util::NowNs() < end) {
+
+	}
+}
+
+void test_preempt_owner() {
+	//a preempted drain goes back to its owner, not to whichever worker is free
+	drainers.assign(8, pthread_t());
+	co::Scheduler sc(2);
+	sc.SetTimeSlice(100);
+	co::ActorSystem actors(sc, 2);
+	for (int i = 0; i < 20; i++) {
+		for (uint64_t key = 0; key < drainers.size(); key++) {
+			actors.Send(key, &spin, key);
+		}
+	}
+	sc.Run();
+	auto stats = sc.Stats();
+	assert(stats.workers[0].preempted + stats.workers[1].preempted > 0);
+	assert(actors.ActiveKeys() == 0);
+}
+
+void noop(uint64_t) {
+
+}
+
+void bench(int keys) {
+	co::Scheduler sc(4);
+	co::ActorSystem actors(sc);
+	uint64_t begin = util::NowNs();
+	for (int seq = 0; seq < 4; seq++) {
+		for (int key = 0; key < keys; key++) {
+			actors.Send(key, &noop, key);
+		}
+	}
+	size_t active = actors.ActiveKeys();
+	sc.Run();
+	logger->Info("actor keys", keys, "active while queued", active, "after run", actors.ActiveKeys(),
+			"ns/message", (util::NowNs() - begin) / (keys * 4));
+}
+
+int main(int argc, char* argv[]) {
+	test_order(1000);
+	test_preempt_owner();
+	bench(argc > 1 ? atoi(argv[1]) : 100000);
+	return 0;
+}
@@ -0,0 +1,145 @@
+#include "arena.h"
+#include "log.h"
+#include "scheduler.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace qf;
+
+static auto logger = GetLogger();
+
+void test_arena() {
+	co::Arena arena;
+	char* a = (char*)arena.Alloc(10, 1);
+	char* b = (char*)arena.Alloc(10, 1);
+	assert(b == a + 10);
+	//the latest allocation shrinks back
+	arena.Free(b, 10);
+	char* again = (char*)arena.Alloc(10, 1);
+	assert(again == b);
+	void* aligned = arena.Alloc(8, 64);
+	assert((uintptr_t)aligned % 64 == 0);
+	for (int i = 0; i < 100; i++) {
+		arena.Alloc(1024);
+	}
+	assert(arena.Chunks() == 2);
+	//oversized blocks stay out of the chunks
+	memset(arena.Alloc(1 << 20), 1, 1 << 20);
+	assert(arena.Chunks() == 2);
+	size_t pooled = co::ArenaPoolSize();
+	arena.Reset();
+	assert(arena.Chunks() == 0 && co::ArenaPoolSize() == pooled + 2);
+}
+
+void test_coroutine_arena() {
+	size_t pooled = co::ArenaPoolSize();
+	co::Arena* used = nullptr;
+	auto co = co::Create([&used]() {
+		used = co::CurrentArena();
+		co::ArenaVector<int> v;
+		for (int i = 0; i < 100000; i++) {
+			v.push_back(i);
+		}
+		co::ArenaString s("coroutine arena string long enough to leave the small buffer");
+		assert(v[99999] == 99999 && s.size() > 32);
+		co::Yield();
+		assert(used->Chunks() > 0);
+	});
+	co::Resume(co);
+	//each coroutine has its own, apart from the thread's
+	assert(used && used != co::CurrentArena());
+	co::Resume(co);
+	assert(used->Chunks() == 0);
+	assert(co::ArenaPoolSize() >= pooled);
+}
+
+static const int strings = 64;
+
+//the same body with either allocator: a request's worth of short strings, joined
+template<class String, class Vector>
+void alloc_task() {
+	Vector parts;
+	for (int i = 0; i < strings; i++) {
+		String part("request header value number ");
+		part += (char)('a' + i % 26);
+		parts.push_back(std::move(part));
+	}
+	String joined;
+	for (auto& part : parts) {
+		joined += part;
+	}
+	assert(joined.size() > 0);
+}
+
+static std::atomic<uint64_t> bodyNs{0};
+
+//the allocations alone: creating the coroutine would dominate a single body
+template<void (*body)()>
+void timed_task(int reps) {
+	uint64_t begin = util::NowNs();
+	for (int i = 0; i < reps; i++) {
+		body();
+	}
+	bodyNs += util::NowNs() - begin;
+}
+
+//the allocator alone, where the default unoptimized build inlines neither side
+void bench_alloc(int n) {
+	std::vector<void*> blocks(n);
+	uint64_t begin = util::NowNs();
+	for (int i = 0; i < n; i++) {
+		blocks[i] = malloc(48);
+	}
+	for (int i = 0; i < n; i++) {
+		free(blocks[i]);
+	}
+	uint64_t mallocNs = util::NowNs() - begin;
+
+	co::Arena arena;
+	begin = util::NowNs();
+	for (int i = 0; i < n; i++) {
+		blocks[i] = arena.Alloc(48);
+	}
+	arena.Reset();
+	uint64_t arenaNs = util::NowNs() - begin;
+	logger->Info("ns/alloc malloc and free", (double)mallocNs / n, "arena", (double)arenaNs / n);
+}
+
+void bench(int n, int reps) {
+	void (*tasks[])(int) = {
+		&timed_task<alloc_task<std::string, std::vector<std::string>>>,
+		&timed_task<alloc_task<co::ArenaString, co::ArenaVector<co::ArenaString>>>,
+	};
+	const char* names[] = { "malloc", "arena" };
+#ifdef __OPTIMIZE__
+	const char* build = "optimized";
+#else
+	//the arena's string and vector templates are compiled here, std::string comes optimized in libstdc++
+	const char* build = "unoptimized, the arena templates run without inlining";
+#endif
+	//the first round warms malloc and the chunk pool up
+	for (int round = 0; round < 2; round++) {
+		for (int k = 0; k < 2; k++) {
+			co::Scheduler sc(1);
+			bodyNs = 0;
+			for (int i = 0; i < n; i++) {
+				sc.Schedule(tasks[k], reps);
+			}
+			sc.Run();
+			if (round) {
+				logger->Info("ns/body", names[k], bodyNs / ((uint64_t)n * reps), "build", build);
+			}
+		}
+	}
+}
+
+int main(int argc, char* argv[]) {
+	test_arena();
+	test_coroutine_arena();
+	bench_alloc(1000000);
+	bench(2000, 20);
+	return 0;
+}
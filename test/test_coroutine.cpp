@@ -16,9 +16,96 @@ void func(int i) {
 	logger->Info("func yield end.", i);
 }
 
+static co::Local<std::string> requestId;
+static int destroyed = 0;
+
+struct Tracked {
+	~Tracked() {
+		destroyed++;
+	}
+};
+
+static co::Local<Tracked> tracked(false);
+
+void test_local() {
+	requestId.Set("main");
+	auto child = co::Create([]() {
+		//inherited from the creator
+		assert(*requestId.Get() == "main");
+		requestId.Set("child");
+		*tracked;
+		co::Yield();
+		assert(*requestId == "child");
+	});
+	co::Resume(child);
+	assert(*requestId == "main");
+	assert(destroyed == 0);
+	co::Resume(child);
+	assert(destroyed == 1);
+
+	auto noInherit = co::Create([]() {
+		assert(!tracked.Get());
+	});
+	*tracked;
+	co::Resume(noInherit);
+	tracked.Reset();
+	assert(destroyed == 2);
+	logger->Info("coroutine local ok");
+}
+
+//burns about depth * 16KB of stack
+static int deep(int depth) {
+	volatile char frame[16 * 1024];
+	frame[0] = (char)depth;
+	frame[sizeof(frame) - 1] = (char)depth;
+	return depth ? deep(depth - 1) + frame[0] : frame[sizeof(frame) - 1];
+}
+
+void leaf(int i) {
+
+}
+
+void other_leaf(int i) {
+
+}
+
+void test_stack_profile() {
+	//1% of 16MB, so the deep task warns
+	co::EnableStackProfile(true, 1);
+	for (int i = 0; i < 4; i++) {
+		co::Resume(co::Create([]() {
+			co::SetName("deep");
+			deep(16);
+		}));
+		co::Resume(co::Create([]() {
+			co::SetName("shallow");
+		}));
+	}
+	co::Resume(co::Create(&leaf, 1));
+	co::Resume(co::Create(&leaf, 2));
+	co::Resume(co::Create(&other_leaf, 1));
+	co::EnableStackProfile(false);
+
+	auto usage = co::StackUsage();
+	assert(usage["deep"].Count() == 4);
+	assert(usage["deep"].Min() >= 16 * 16 * 1024);
+	assert(usage["shallow"].Max() < 16 * 1024);
+	//unnamed tasks go by the type of their callable, plain functions each by their own symbol or address
+	assert(usage.size() == 4);
+	for (auto& iter : usage) {
+		if (iter.first != "deep" && iter.first != "shallow") {
+			assert(iter.first.find("leaf") != std::string::npos || iter.first.find("void (*)(int) at ") == 0);
+		}
+	}
+	co::ReportStackUsage();
+}
+
 #if 1
 int main(int argc, char* argv[])
 {
+	test_local();
+	test_stack_profile();
+
 	auto cofunc = co::Create(func, 100);
 	auto colambda = co::Create([cofunc]() {
 		logger->Info("resume func begin 1.");
@@ -0,0 +1,225 @@
+#include "generator.h"
+#include "log.h"
+#include "scheduler.h"
+#include <assert.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace qf;
+
+static auto logger = GetLogger();
+
+co::Generator<int> range(int n) {
+	return co::Generator<int>([n](co::Generator<int>::Yielder& yield) {
+		for (int i = 0; i < n; i++) {
+			//i itself goes out, by reference
+			if (!yield(i)) {
+				return;
+			}
+		}
+	});
+}
+
+static int copies = 0;
+
+struct Row {
+	Row(int id)
+		: id(id) {
+
+	}
+
+	Row(const Row& other)
+		: id(other.id) {
+		copies++;
+	}
+
+	int id;
+	char payload[256];
+};
+
+void test_basic() {
+	int sum = 0;
+	for (int i : range(10)) {
+		sum += i;
+	}
+	assert(sum == 45);
+
+	//the consumer sees the producer's object
+	Row row(7);
+	co::Generator<Row> same([&row](co::Generator<Row>::Yielder& yield) {
+		yield(row);
+	});
+	for (auto& r : same) {
+		assert(&r == &row);
+	}
+
+	//a temporary may be moved from
+	co::Generator<std::unique_ptr<int>> owned([](co::Generator<std::unique_ptr<int>>::Yielder& yield) {
+		for (int i = 0; i < 3; i++) {
+			yield(std::unique_ptr<int>(new int(i)));
+		}
+	});
+	int n = 0;
+	for (auto& p : owned) {
+		auto taken = std::move(p);
+		assert(*taken == n++);
+	}
+	assert(n == 3);
+
+	int empty = 0;
+	for (int i : range(0)) {
+		empty += i + 1;
+	}
+	assert(empty == 0);
+}
+
+void test_pipeline() {
+	auto rows = co::Generator<Row>([](co::Generator<Row>::Yielder& yield) {
+		for (int i = 0; i < 1000; i++) {
+			Row row(i);
+			yield(row);
+		}
+	});
+	copies = 0;
+	int64_t sum = 0;
+	int count = 0;
+	for (auto id : std::move(rows)
+			.Filter([](const Row& r) { return r.id % 3 == 0; })
+			.Map([](const Row& r) { return (int64_t)r.id * r.id; })
+			.Filter([](int64_t v) { return v % 2 == 0; })) {
+		sum += id;
+		count++;
+	}
+	//multiples of 6 below 1000, squared, with no Row copied on the way
+	int64_t expect = 0;
+	for (int64_t i = 0; i < 1000; i += 6) {
+		expect += i * i;
+	}
+	assert(sum == expect && count == 167);
+	assert(copies == 0);
+
+	//rows it only may read go out through Generator<const Row>, by reference all the same
+	std::vector<Row> stored;
+	stored.reserve(100);
+	for (int i = 0; i < 100; i++) {
+		stored.emplace_back(i);
+	}
+	const auto& table = stored;
+	copies = 0;
+	auto view = co::Generator<const Row>([&table](co::Generator<const Row>::Yielder& yield) {
+		for (const auto& r : table) {
+			if (!yield(r)) {
+				return;
+			}
+		}
+	});
+	int seen = 0;
+	for (const Row& r : std::move(view).Filter([](const Row& r) { return r.id % 2 == 0; })) {
+		assert(&r == &table[seen]);
+		seen += 2;
+	}
+	assert(seen == 100 && copies == 0);
+
+	//generators feeding generators
+	auto inner = std::make_shared<co::Generator<int>>(range(5));
+	co::Generator<std::string> words([inner](co::Generator<std::string>::Yielder& yield) {
+		for (int i : *inner) {
+			yield(std::string(i + 1, 'x'));
+		}
+	});
+	std::string all;
+	for (auto& w : words) {
+		all += w;
+	}
+	assert(all.size() == 15);
+}
+
+static bool unwound = false;
+
+struct Guard {
+	~Guard() {
+		unwound = true;
+	}
+};
+
+void test_stop() {
+	{
+		co::Generator<int> endless([](co::Generator<int>::Yielder& yield) {
+			Guard guard;
+			for (int i = 0; ; i++) {
+				if (!yield(i)) {
+					return;
+				}
+			}
+		});
+		for (int i : endless) {
+			if (i == 3) {
+				break;
+			}
+		}
+		assert(!unwound);
+	}
+	//the generator was dropped mid-stream, its body returned through its destructors
+	assert(unwound);
+
+	//one never started just goes
+	auto unused = range(10);
+}
+
+static std::atomic<int64_t> total{0};
+
+void consume(int n) {
+	int64_t sum = 0;
+	for (int v : range(n).Map([](int i) { return i * 2; })) {
+		sum += v;
+	}
+	total += sum;
+}
+
+void test_scheduler() {
+	co::Scheduler sc(2);
+	for (int i = 0; i < 16; i++) {
+		sc.Schedule(&consume, 1000);
+	}
+	sc.Run();
+	assert(total == 16 * 999 * 1000);
+}
+
+void bench(int n) {
+	uint64_t begin = util::NowNs();
+	int64_t sum = 0;
+	for (int v : range(n).Filter([](int i) { return i & 1; }).Map([](int i) { return i * 3; })) {
+		sum += v;
+	}
+	uint64_t streamNs = util::NowNs() - begin;
+
+	begin = util::NowNs();
+	std::vector<int> all;
+	for (int i = 0; i < n; i++) {
+		all.push_back(i);
+	}
+	std::vector<int> odd;
+	for (int i : all) {
+		if (i & 1) {
+			odd.push_back(i);
+		}
+	}
+	int64_t check = 0;
+	for (int i : odd) {
+		check += i * 3;
+	}
+	uint64_t vectorNs = util::NowNs() - begin;
+	assert(sum == check);
+	logger->Info("ns/value generator", (double)streamNs / n, "vectors", (double)vectorNs / n,
+			"vector bytes", (all.capacity() + odd.capacity()) * sizeof(int));
+}
+
+int main(int argc, char* argv[]) {
+	test_basic();
+	test_pipeline();
+	test_stop();
+	test_scheduler();
+	bench(1000000);
+	return 0;
+}
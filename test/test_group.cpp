@@ -0,0 +1,243 @@
+#include "group.h"
+#include "io.h"
+#include "log.h"
+#include "scheduler.h"
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+
+using namespace qf;
+
+static auto logger = GetLogger();
+
+static std::atomic<int> ran{0};
+
+void count_func() {
+	ran++;
+}
+
+void test_wait() {
+	co::Scheduler sc(2);
+	co::TaskGroup group(&sc);
+	int spawned = 0;
+	for (int i = 0; i < 100; i++) {
+		spawned += group.Spawn(&count_func);
+	}
+	assert(spawned == 100);
+	sc.Run();
+	group.Wait();
+	assert(ran == 100);
+	auto stats = group.Stats();
+	assert(stats.spawned == 100 && stats.completed == 100 && stats.removed == 0);
+
+	//a coroutine waits for the tasks it spawned, its worker runs them meanwhile
+	ran = 0;
+	co::Scheduler one(1);
+	one.Schedule([]() {
+		co::TaskGroup sub;
+		for (int i = 0; i < 50; i++) {
+			sub.Spawn(&count_func);
+		}
+		sub.Wait();
+		assert(ran == 50);
+		ran++;
+	});
+	one.Run();
+	assert(ran == 51);
+	//a coroutine that task resumes itself blocks its worker, the other one runs them
+	ran = 0;
+	co::Scheduler two(2);
+	two.Schedule([]() {
+		auto child = co::Create([]() {
+			co::TaskGroup sub;
+			for (int i = 0; i < 50; i++) {
+				sub.Spawn(&count_func);
+			}
+			sub.Wait();
+			assert(ran == 50);
+		});
+		co::Resume(child);
+		assert(child->status == co::CoStatus::DEAD);
+	});
+	two.Run();
+	assert(ran == 50);
+}
+
+void test_cancel_queued() {
+	ran = 0;
+	co::Scheduler sc(1);
+	co::TaskGroup group(&sc);
+	for (int i = 0; i < 1000; i++) {
+		group.Spawn(&count_func);
+	}
+	sc.Schedule(&count_func);
+	uint64_t removed = group.Cancel();
+	bool late = group.Spawn(&count_func);
+	assert(removed == 1000 && !late);
+	group.Wait();
+	//only the task outside the group is left
+	sc.Run();
+	assert(ran == 1);
+	assert(sc.Stats().cancelled == 1000 && sc.Stats().queueDepth == 0);
+	assert(group.Stats().removed == 1000);
+}
+
+void test_cancel_running() {
+	ran = 0;
+	co::Scheduler sc(2);
+	co::TaskGroup group(&sc);
+	std::atomic<int> started{0};
+	std::atomic<int> loops{0};
+	std::atomic<int> saw{0};
+	for (int i = 0; i < 2; i++) {
+		group.Spawn([&sc, &started, &loops, &saw]() {
+			started++;
+			while (!co::CheckCancelled()) {
+				loops++;
+				sc.Preempt();
+			}
+			//the io calls refuse to start once cancelled
+			char c;
+			ssize_t got = io::Read(0, &c, 1);
+			assert(got == -1 && errno == ECANCELED);
+			//a group made now starts cancelled, plain tasks are not part of the group
+			co::TaskGroup nested;
+			bool spawned = nested.Spawn(&count_func);
+			assert(nested.Cancelled() && !spawned);
+			sc.Schedule([&saw]() {
+				if (!co::CheckCancelled() && co::MaybeYield()) {
+					saw++;
+				}
+			});
+		});
+	}
+	//both running, or Cancel would take the one still queued back
+	sc.Schedule([&group, &started, &loops]() {
+		while (started < 2 || loops < 100) {
+			co::Scheduler::Current()->Preempt();
+		}
+		group.Cancel();
+	});
+	sc.Run();
+	group.Wait();
+	assert(saw == 2);
+	assert(!co::CheckCancelled());
+}
+
+void test_nested() {
+	ran = 0;
+	co::Scheduler sc(1);
+	co::TaskGroup outer(&sc);
+	std::atomic<uint64_t> removed{0};
+	outer.Spawn([&outer, &removed]() {
+		co::TaskGroup inner;
+		for (int i = 0; i < 100; i++) {
+			inner.Spawn(&count_func);
+		}
+		//cancelling the outer group takes the inner group's queued tasks too
+		removed = outer.Cancel();
+		inner.Wait();
+		assert(inner.Stats().removed == 100);
+	});
+	sc.Run();
+	outer.Wait();
+	assert(removed == 100 && ran == 0);
+}
+
+// inline tasks and blocking jobs of a cancelled group leave nothing behind on their threads
+void test_no_bleed() {
+	co::Scheduler sc(1);
+	sc.SetBlockingPool(1, 1000);
+	co::TaskGroup group(&sc);
+	group.Spawn([&sc, &group]() {
+		sc.ScheduleInline([]() {
+			assert(!co::CheckCancelled());
+		});
+		group.Cancel();
+		co::RunBlocking([]() {
+			assert(!co::CheckCancelled());
+		});
+		assert(co::CheckCancelled());
+	});
+	sc.Run();
+	group.Wait();
+	std::atomic<int> clean{0};
+	for (int i = 0; i < 4; i++) {
+		sc.Schedule([&clean]() {
+			char c;
+			bool ok = !co::CheckCancelled() && co::MaybeYield();
+			co::RunBlocking([&ok]() {
+				char c;
+				ok = ok && !co::CheckCancelled() && io::Read(-1, &c, 1) == -1 && errno == EBADF;
+			});
+			ok = ok && io::Read(-1, &c, 1) == -1 && errno == EBADF;
+			clean += ok;
+		});
+	}
+	sc.ScheduleInline([&clean]() {
+		clean += !co::CheckCancelled();
+	});
+	sc.Run();
+	assert(clean == 5);
+}
+
+static std::atomic<uint64_t> units{0};
+
+// a subtask: work in steps, giving up between them once the request is cancelled
+void subtask(co::TaskGroup* group, int id, int fail) {
+	for (int step = 0; step < 100; step++) {
+		if (!co::MaybeYield()) {
+			return;
+		}
+		volatile uint64_t x = 0;
+		for (int i = 0; i < 1000; i++) {
+			x += i;
+		}
+		units++;
+		if (id == fail && step == 10) {
+			group->Cancel();
+			return;
+		}
+	}
+}
+
+// a fan-out request whose fail'th subtask fails early on, -1 for none
+uint64_t request(int subtasks, int fail, co::TaskGroupStats& stats) {
+	units = 0;
+	co::Scheduler sc(2);
+	sc.SetTimeSlice(100);
+	sc.Schedule([&]() {
+		co::TaskGroup group;
+		for (int i = 0; i < subtasks; i++) {
+			group.Spawn(&subtask, &group, i, fail);
+		}
+		group.Wait();
+		stats = group.Stats();
+	});
+	sc.Run();
+	return units;
+}
+
+void test_partial_failure() {
+	co::TaskGroupStats stats;
+	uint64_t full = request(200, -1, stats);
+	assert(full == 200 * 100 && stats.completed == 200);
+	uint64_t begin = util::NowNs();
+	uint64_t wasted = request(200, 3, stats);
+	uint64_t ns = util::NowNs() - begin;
+	//the failure may come before the parent spawned them all, Spawn refuses the rest
+	assert(stats.completed + stats.removed + stats.skipped == stats.spawned);
+	assert(wasted < full);
+	logger->Info("work units after a failure", wasted, "of", full, "spawned", stats.spawned, "removed", stats.removed,
+			"skipped", stats.skipped, "ms", ns / 1000000);
+}
+
+int main(int argc, char* argv[]) {
+	test_wait();
+	test_cancel_queued();
+	test_cancel_running();
+	test_nested();
+	test_no_bleed();
+	test_partial_failure();
+	return 0;
+}
@@ -0,0 +1,37 @@
+#include "histogram.h"
+#include "log.h"
+#include <assert.h>
+
+using namespace qf;
+
+static auto logger = GetLogger();
+
+int main(int argc, char* argv[]) {
+	uint64_t values[] = { 0, 1, 15, 16, 17, 1000, 123456789, (uint64_t)-1 };
+	for (uint64_t v : values) {
+		int idx = util::HistogramBuckets::Index(v);
+		assert(idx < util::HistogramBuckets::count);
+		assert(util::HistogramBuckets::LowerBound(idx) <= v);
+		assert(util::HistogramBuckets::UpperBound(idx) >= v);
+	}
+
+	util::Histogram h;
+	for (uint64_t i = 1; i <= 10000; i++) {
+		h.Record(i);
+	}
+	assert(h.Count() == 10000);
+	assert(h.Min() == 1 && h.Max() == 10000);
+	uint64_t p50 = h.Percentile(50);
+	assert(p50 >= 5000 && p50 <= 5000 * 1.125);
+	logger->Info("histogram", h.Summary());
+
+	util::AtomicHistogram ah;
+	ah.Record(100);
+	ah.Record(200);
+	util::Histogram merged;
+	ah.MergeTo(merged);
+	merged.Merge(h);
+	assert(merged.Count() == 10002);
+	logger->Info("merged", merged.Summary());
+	return 0;
+}
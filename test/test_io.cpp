@@ -0,0 +1,144 @@
+#include "io.h"
+#include "log.h"
+#include "scheduler.h"
+#include <arpa/inet.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace qf;
+
+static auto logger = GetLogger();
+
+static std::atomic<int> finished{0};
+
+void file_roundtrip(int i) {
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/qf_test_io_%d_%d", getpid(), i);
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	assert(fd >= 0);
+	char buf[4096];
+	memset(buf, 'a' + i % 26, sizeof(buf));
+	ssize_t written = io::Write(fd, buf, sizeof(buf), 0);
+	assert(written == sizeof(buf));
+	written = io::Write(fd, buf, 100);
+	assert(written == 100);
+	int synced = io::Fsync(fd, true);
+	assert(synced == 0);
+	char back[4096];
+	ssize_t got = io::Read(fd, back, sizeof(back), 0);
+	assert(got == sizeof(back));
+	assert(memcmp(buf, back, sizeof(buf)) == 0);
+	got = io::Read(-1, back, 1);
+	assert(got == -1 && errno == EBADF);
+	close(fd);
+	unlink(path);
+	finished++;
+}
+
+void test_files(uint32_t threads) {
+	finished = 0;
+	co::Scheduler sc(threads);
+	for (int i = 0; i < 64; i++) {
+		sc.Schedule(&file_roundtrip, i);
+	}
+	sc.Run();
+	assert(finished == 64);
+}
+
+//a coroutine the task made and resumes itself blocks instead of suspending onto the ring
+void test_nested() {
+	finished = 0;
+	co::Scheduler sc(1);
+	sc.Schedule([]() {
+		auto child = co::Create(&file_roundtrip, 100);
+		co::Resume(child);
+		assert(finished == 1);
+	});
+	sc.Run();
+	assert(finished == 1);
+}
+
+//one worker: the accept must not block it, or the connect task never runs
+void test_accept() {
+	int lfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int ret = bind(lfd, (struct sockaddr*)&addr, sizeof(addr));
+	assert(ret == 0);
+	ret = listen(lfd, 16);
+	assert(ret == 0);
+	socklen_t len = sizeof(addr);
+	getsockname(lfd, (struct sockaddr*)&addr, &len);
+
+	int accepted = -1;
+	co::Scheduler sc(1);
+	sc.Schedule([lfd, &accepted]() {
+		struct sockaddr_in peer;
+		socklen_t peerLen = sizeof(peer);
+		accepted = io::Accept(lfd, (struct sockaddr*)&peer, &peerLen, SOCK_CLOEXEC);
+	});
+	sc.Schedule([addr]() {
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int ret = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+		assert(ret == 0);
+		close(fd);
+	});
+	sc.Run();
+	assert(accepted >= 0);
+	close(accepted);
+	close(lfd);
+}
+
+static int count_lines(const char* path) {
+	FILE* fp = fopen(path, "r");
+	assert(fp);
+	int lines = 0, c;
+	while ((c = fgetc(fp)) != EOF) {
+		lines += c == '\n';
+	}
+	fclose(fp);
+	return lines;
+}
+
+void test_file_writer(uint32_t batch, int n) {
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/qf_test_io_%d.log", getpid());
+	uint64_t begin;
+	{
+		log::Logger lg;
+		lg.SetLogLevel(log::LogLevel::CRITICAL, "default");
+		lg.AddFileWriter(path, batch);
+		begin = util::NowNs();
+		for (int i = 0; i < n; i++) {
+			lg.Info("line", i);
+		}
+		lg.Flush();
+	}
+	uint64_t ns = util::NowNs() - begin;
+	assert(count_lines(path) == n);
+	unlink(path);
+	logger->Info("file writer batch", batch, "uring", io::UringAvailable(), "ns/line", ns / n);
+}
+
+int main(int argc, char* argv[]) {
+	logger->Info("io_uring available", io::UringAvailable());
+	test_files(1);
+	test_files(4);
+	test_nested();
+	test_file_writer(1, 20000);
+	test_file_writer(64, 20000);
+	if (io::UringAvailable()) {
+		test_accept();
+	}
+
+	io::SetUringEnabled(false);
+	test_files(4);
+	test_file_writer(64, 20000);
+	return 0;
+}
@@ -0,0 +1,123 @@
+#include "lock.h"
+#include "log.h"
+#include "thread.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+using namespace qf;
+
+static auto logger = GetLogger();
+
+static const int opsTotal = 200000;
+static uint64_t counter = 0;
+
+template<class Mu>
+static void worker(Mu* mu, int ops) {
+	for (int i = 0; i < ops; i++) {
+		thread::LockGuard<Mu> lock(*mu);
+		counter++;
+	}
+}
+
+//one write in readEvery, the rest under the read lock
+static void rw_worker(thread::RWLock* rw, int readEvery, int ops) {
+	uint64_t sum = 0;
+	for (int i = 0; i < ops; i++) {
+		if (i % readEvery == 0) {
+			thread::LockGuard<thread::RWLock> lock(*rw);
+			counter++;
+		} else {
+			thread::ReadLockGuard<thread::RWLock> lock(*rw);
+			sum += counter;
+		}
+	}
+	(void)sum;
+}
+
+template<class F, class... ArgList>
+static double bench(int threads, F f, ArgList... argList) {
+	counter = 0;
+	std::vector<thread::ThreadPtr> vec;
+	uint64_t begin = util::NowNs();
+	for (int i = 0; i < threads; i++) {
+		auto thd = thread::CreateThread(f, argList..., opsTotal / threads);
+		thd->Run();
+		vec.push_back(thd);
+	}
+	for (auto& thd : vec) {
+		thd->Join();
+	}
+	return (double)(util::NowNs() - begin) / opsTotal;
+}
+
+static void test_guards() {
+	thread::AdaptiveMutex mu;
+	{
+		thread::UniqueLock<thread::AdaptiveMutex> lock(mu);
+		assert(lock.OwnsLock());
+		thread::UniqueLock<thread::AdaptiveMutex> other(mu, thread::TryToLock());
+		assert(!other);
+		lock.Unlock();
+		bool taken = other.TryLock();
+		assert(taken);
+	}
+	bool unlocked = mu.TryLock();
+	assert(unlocked);
+	mu.Unlock();
+
+	thread::Mutex m;
+	{
+		thread::UniqueLock<thread::Mutex> lock(m, thread::DeferLock());
+		assert(!lock.OwnsLock());
+		bool taken = lock.TryLock();
+		assert(taken);
+	}
+
+	thread::RWLock rw;
+	bool first = rw.TryReadLock();
+	bool second = rw.TryReadLock();
+	bool writer = rw.TryLock();
+	assert(first && second && !writer);
+	rw.ReadUnlock();
+	rw.ReadUnlock();
+	writer = rw.TryLock();
+	bool reader = rw.TryReadLock();
+	assert(writer && !reader);
+	rw.Unlock();
+
+	thread::TicketLock tl;
+	bool once = tl.TryLock();
+	bool twice = tl.TryLock();
+	assert(once && !twice);
+	tl.Unlock();
+}
+
+int main(int argc, char* argv[]) {
+	test_guards();
+
+	//rounds past the core count measure the locks oversubscribed, the spinning ones suffer most
+	int maxThreads = argc > 1 ? atoi(argv[1]) : 64;
+	int cores = (int)std::thread::hardware_concurrency();
+	thread::Mutex mutex;
+	thread::AdaptiveMutex adaptive;
+	thread::TicketLock ticket;
+	thread::RWLock rw;
+
+	for (int threads = 2; threads <= maxThreads; threads *= 2) {
+		int ops = opsTotal / threads * threads;
+		double tMutex = bench(threads, &worker<thread::Mutex>, &mutex);
+		assert(counter == (uint64_t)ops);
+		double tAdaptive = bench(threads, &worker<thread::AdaptiveMutex>, &adaptive);
+		assert(counter == (uint64_t)ops);
+		double tTicket = bench(threads, &worker<thread::TicketLock>, &ticket);
+		assert(counter == (uint64_t)ops);
+		double tRWrite = bench(threads, &rw_worker, &rw, 1);
+		assert(counter == (uint64_t)ops);
+		double tRRead = bench(threads, &rw_worker, &rw, 20);
+		logger->Info("threads", threads, "cores", cores, "ns/op mutex", tMutex, "adaptive", tAdaptive,
+				"ticket", tTicket, "rwlock(write)", tRWrite, "rwlock(5% write)", tRRead);
+	}
+	return 0;
+}
@@ -1,11 +1,267 @@
+#include <assert.h>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
 #include <string>
+#include <unistd.h>
+#include <vector>
 #include "log.h"
+#include "ratelimit.h"
+#include "segment.h"
+#include "thread.h"
 
 static auto logger = qf::GetLogger("system");
 
 template<class T>
 using is_bool = util::is_bool<T>;
 
+using namespace qf;
+
+void test_limits() {
+	static log::RateLimitSite site(__FILE__, __LINE__, 10);
+	int allowed = 0;
+	log::RateLimitSite::Counter* dropped = nullptr;
+	for (int i = 0; i < 100000; i++) {
+		allowed += site.Allow(dropped);
+	}
+	//a burst of 10, plus one per 100ms should the loop be slow
+	assert(allowed >= 10 && allowed <= 12);
+	uint64_t suppressed = site.TakeSuppressed();
+	assert(suppressed == (uint64_t)(100000 - allowed));
+	suppressed = site.TakeSuppressed();
+	assert(suppressed == 0);
+
+	//a thread that drops a few and exits: they still get reported, and the next thread counts on
+	static log::RateLimitSite slow(__FILE__, __LINE__, 1);
+	bool first = slow.Allow(dropped);
+	assert(first);
+	for (int n = 5; n < 7; n++) {
+		auto thd = thread::CreateThread([n]() {
+			static thread_local log::RateLimitSite::Counter* own = nullptr;
+			for (int i = 0; i < n; i++) {
+				bool allow = slow.Allow(own);
+				assert(!allow);
+			}
+		});
+		thd->Run();
+		thd->Join();
+		suppressed = slow.TakeSuppressed();
+		assert(suppressed == (uint64_t)n);
+	}
+
+	//what a thread dropped comes with its next message
+	std::string path = "/tmp/qf_test_limits_" + std::to_string(getpid()) + ".log";
+	auto lg = std::make_shared<log::Logger>();
+	lg->SetLogLevel(log::LogLevel::CRITICAL, "default");
+	lg->AddFileWriter(path);
+	for (int round = 0; round < 2; round++) {
+		for (int i = 0; i < 100; i++) {
+			QF_LOG_RATE(lg, WARNING, 10, "limited", i);
+		}
+		usleep(150000);
+	}
+	lg->Flush();
+	std::ifstream ifs(path);
+	std::stringstream ss;
+	ss << ifs.rdbuf();
+	assert(ss.str().find("limited 0 (90 messages suppressed)") != std::string::npos);
+	unlink(path.c_str());
+
+	log::SampleSite sample(100);
+	int sampled = 0;
+	for (int i = 0; i < 1000; i++) {
+		sampled += sample.Allow();
+	}
+	assert(sampled == 10);
+}
+
+void hot_path(int n) {
+	for (int i = 0; i < n; i++) {
+		QF_LOG_RATE(logger, WARNING, 5, "hot path warning", i);
+	}
+}
+
+void bench(int n) {
+	uint64_t begin = util::NowNs();
+	for (int i = 0; i < n; i++) {
+		logger->Debug("disabled", i);
+	}
+	uint64_t levelNs = util::NowNs() - begin;
+
+	begin = util::NowNs();
+	hot_path(n);
+	uint64_t limitedNs = util::NowNs() - begin;
+
+	begin = util::NowNs();
+	for (int i = 0; i < n; i++) {
+		QF_LOG_EVERY_N(logger, INFO, 100000, "sampled", i);
+	}
+	uint64_t sampledNs = util::NowNs() - begin;
+
+	//the same site from several threads at once
+	begin = util::NowNs();
+	std::vector<thread::ThreadPtr> threads;
+	for (int i = 0; i < 4; i++) {
+		threads.push_back(thread::CreateThread(&hot_path, n));
+		threads.back()->Run();
+	}
+	for (auto& t : threads) {
+		t->Join();
+	}
+	uint64_t sharedNs = util::NowNs() - begin;
+	log::ReportSuppressed(logger);
+	logger->Info("ns/call level check", levelNs / n, "rate limited", limitedNs / n, "by 4 threads", sharedNs / (4 * n),
+			"sampled", sampledNs / n);
+}
+
+//lookups, new loggers, level changes and logging all at once from several threads
+void registry_worker(int id) {
+	char name[64];
+	for (int i = 0; i < 2000; i++) {
+		snprintf(name, sizeof(name), "/tmp/qf_test_log_%d_%d", getpid(), i % 8);
+		auto lg = GetLogger(name);
+		lg->SetLogLevel(i % 2 ? log::LogLevel::ERROR : log::LogLevel::CRITICAL, "default");
+		lg->SetLogLevel(log::LogLevel::DEBUG, name);
+		lg->Debug("worker", id, "iteration", i);
+	}
+}
+
+void test_registry() {
+	std::vector<thread::ThreadPtr> threads;
+	for (int i = 0; i < 4; i++) {
+		threads.push_back(thread::CreateThread(&registry_worker, i));
+		threads.back()->Run();
+	}
+	for (auto& t : threads) {
+		t->Join();
+	}
+	char name[64];
+	for (int i = 0; i < 8; i++) {
+		snprintf(name, sizeof(name), "/tmp/qf_test_log_%d_%d", getpid(), i);
+		assert(GetLogger(name) == GetLogger(name));
+		GetLogger(name)->Flush();
+		unlink(name);
+	}
+	assert(QF_LOGGER("system") == logger);
+
+	int n = 1000000;
+	uint64_t begin = util::NowNs();
+	for (int i = 0; i < n; i++) {
+		GetLogger("system")->Debug("lookup", i);
+	}
+	uint64_t lookupNs = util::NowNs() - begin;
+	begin = util::NowNs();
+	for (int i = 0; i < n; i++) {
+		QF_LOGGER("system")->Debug("cached", i);
+	}
+	logger->Info("ns/call GetLogger", lookupNs / n, "QF_LOGGER", (util::NowNs() - begin) / n);
+}
+
+//reads the whole segment file back, checking "line <i>" runs on from each frame's first line
+static uint32_t read_segment(const std::string& path, uint64_t offset = 0, uint32_t* first = nullptr) {
+	log::SegmentReader reader(path);
+	assert(reader.Ok());
+	reader.Seek(offset);
+	std::string text;
+	uint32_t lines = 0;
+	while (reader.Next(text)) {
+		assert(reader.FrameOffset() >= offset);
+		size_t pos = 0;
+		for (uint32_t i = 0; i < reader.FrameLines(); i++) {
+			size_t end = text.find('\n', pos);
+			assert(end != std::string::npos);
+			uint32_t n = (uint32_t)atoi(text.c_str() + text.rfind(' ', end) + 1);
+			if (first && lines == 0) {
+				*first = n;
+			}
+			pos = end + 1;
+			lines++;
+		}
+		assert(pos == text.size());
+	}
+	return lines;
+}
+
+static uint64_t file_size(const std::string& path) {
+	FILE* fp = fopen(path.c_str(), "rb");
+	fseek(fp, 0, SEEK_END);
+	uint64_t size = ftell(fp);
+	fclose(fp);
+	return size;
+}
+
+void test_segment() {
+	std::string path = "/tmp/qf_test_segment_" + std::to_string(getpid()) + ".logz";
+	const uint32_t n = 20000;
+	{
+		log::Logger lg;
+		lg.SetLogLevel(log::LogLevel::CRITICAL, "default");
+		auto writer = std::make_shared<log::SegmentWriter>(std::make_shared<log::LogFormater>(), path, "zlib", 16 * 1024);
+		lg.AddWriter(path, writer);
+		for (uint32_t i = 0; i < n; i++) {
+			lg.Info("segment test line", i);
+		}
+		lg.Flush();
+		logger->Info("segment raw", writer->RawBytes(), "file", writer->FileBytes());
+		assert(writer->FileBytes() == file_size(path));
+		if (log::GetCodec("zlib")) {
+			assert(writer->FileBytes() * 3 < writer->RawBytes());
+		}
+	}
+	assert(read_segment(path) == n);
+
+	//starting anywhere resyncs on the next frame
+	uint32_t first = 0;
+	uint32_t rest = read_segment(path, file_size(path) / 2, &first);
+	assert(rest > 0 && rest < n && first + rest == n);
+
+	//a flipped byte costs its frame only
+	FILE* fp = fopen(path.c_str(), "r+b");
+	fseek(fp, 100, SEEK_SET);
+	int c = fgetc(fp);
+	fseek(fp, 100, SEEK_SET);
+	fputc(c ^ 0xff, fp);
+	fclose(fp);
+	uint32_t survived = read_segment(path);
+	assert(survived < n && survived > n / 2);
+
+	//a crash mid-write leaves a torn tail, the frames before it still read
+	int ret = truncate(path.c_str(), file_size(path) - 10);
+	assert(ret == 0);
+	assert(read_segment(path) < survived);
+	unlink(path.c_str());
+}
+
+// the logging side of plain batched files against zlib segments of the default 256KB frames,
+// Flush included, so the compression is paid for. the target: lines/s at most 15% below the file's
+void bench_segment(int n) {
+	std::string plain = "/tmp/qf_bench_plain_" + std::to_string(getpid()) + ".log";
+	std::string packed = "/tmp/qf_bench_packed_" + std::to_string(getpid()) + ".logz";
+	const uint32_t frameBytes = 256 * 1024;
+	uint64_t ns[2];
+	for (int k = 0; k < 2; k++) {
+		log::Logger lg;
+		lg.SetLogLevel(log::LogLevel::CRITICAL, "default");
+		if (k == 0) {
+			lg.AddFileWriter(plain, 64);
+		} else {
+			lg.AddSegmentWriter(packed, "zlib", frameBytes);
+		}
+		uint64_t begin = util::NowNs();
+		for (int i = 0; i < n; i++) {
+			lg.Info("request served path /api/v1/items status", 200, "bytes", i * 7, "latency(us)", i % 1000);
+		}
+		lg.Flush();
+		ns[k] = util::NowNs() - begin;
+	}
+	double ratio = (double)ns[0] / ns[1];
+	logger->Info("frame bytes", frameBytes, "lines/s file", (uint64_t)n * 1000000000 / ns[0], "segment",
+			(uint64_t)n * 1000000000 / ns[1], "segment/file throughput", ratio,
+			"bytes file", file_size(plain), "segment", file_size(packed));
+	unlink(plain.c_str());
+	unlink(packed.c_str());
+}
+
 int main(int argc, char* argv[]) {
 	int a = 1;
 	logger->Error("this is an error", a);
@@ -15,5 +271,11 @@ int main(int argc, char* argv[]) {
 	auto b1 = is_bool<bool>::value;
 	auto b2 = is_bool<const bool>::value;
 	logger->Info("type bool", b1, b2);
+
+	test_limits();
+	test_registry();
+	test_segment();
+	bench(1000000);
+	bench_segment(200000);
 	return 0;
 }
@@ -0,0 +1,118 @@
+#include "log.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "thread.h"
+#include <assert.h>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+using namespace qf;
+
+static auto logger = GetLogger();
+
+static const profile::SiteReport* Find(const std::vector<profile::SiteReport>& reports, const std::string& name) {
+	for (auto& report : reports) {
+		if (report.name == name) {
+			return &report;
+		}
+	}
+	return nullptr;
+}
+
+void sleepy(int us) {
+	QF_PROFILE_SCOPE("sleepy");
+	usleep(us);
+}
+
+void task(int i) {
+	QF_PROFILE_SCOPE("task");
+	for (int k = 0; k < 10; k++) {
+		QF_PROFILE_SCOPE("task.inner");
+		co::Scheduler::Current()->Preempt();
+	}
+}
+
+void test_sites() {
+	for (int i = 0; i < 20; i++) {
+		sleepy(1000);
+	}
+	co::Scheduler sc(2);
+	for (int i = 0; i < 100; i++) {
+		sc.Schedule(&task, i);
+	}
+	sc.Run();
+
+	auto reports = profile::Collect();
+	auto s = Find(reports, "sleepy");
+	assert(s && s->ticks.Count() == 20);
+	assert(s->Ns(s->ticks.Percentile(50)) >= 900 * 1000);
+	assert(s->Ns(s->ticks.Max()) < 1000 * 1000 * 1000);
+	//the workers' histograms merged
+	auto t = Find(reports, "task");
+	auto inner = Find(reports, "task.inner");
+	assert(t && t->ticks.Count() == 100);
+	assert(inner && inner->ticks.Count() == 1000);
+	assert(inner->line != t->line && inner->file == t->file);
+	profile::Report();
+
+	bool written = profile::WriteJson("profile.json");
+	assert(written);
+	std::ifstream ifs("profile.json");
+	std::stringstream ss;
+	ss << ifs.rdbuf();
+	assert(ss.str().find("\"name\":\"task.inner\"") != std::string::npos);
+	assert(ss.str().find("\"count\":1000") != std::string::npos);
+}
+
+void quoted() {
+	QF_PROFILE_SCOPE("say \"hi\"");
+}
+
+void test_exited() {
+	//each thread's samples stay after it exits, the next thread takes over its table
+	for (int i = 0; i < 4; i++) {
+		auto t = thread::CreateThread([]() {
+			QF_PROFILE_SCOPE("exited");
+			quoted();
+		});
+		t->Run();
+		t->Join();
+	}
+	auto reports = profile::Collect();
+	auto e = Find(reports, "exited");
+	assert(e && e->ticks.Count() == 4);
+
+	bool written = profile::WriteJson("profile.json");
+	assert(written);
+	std::ifstream ifs("profile.json");
+	std::stringstream ss;
+	ss << ifs.rdbuf();
+	assert(ss.str().find("\"name\":\"say \\\"hi\\\"\"") != std::string::npos);
+}
+
+static int64_t sink = 0;
+
+void empty_scope(int i) {
+	QF_PROFILE_SCOPE("bench");
+	sink += i;
+}
+
+void bench(int n) {
+	uint64_t begin = util::NowNs();
+	for (int i = 0; i < n; i++) {
+		empty_scope(i);
+	}
+	uint64_t ns = util::NowNs() - begin;
+	auto reports = profile::Collect();
+	auto b = Find(reports, "bench");
+	assert(b && b->ticks.Count() == (uint64_t)n);
+	logger->Info("ns/scope", (double)ns / n, "recorded p50(ns)", b->Ns(b->ticks.Percentile(50)));
+}
+
+int main(int argc, char* argv[]) {
+	test_sites();
+	test_exited();
+	bench(1000000);
+	return 0;
+}
@@ -1,5 +1,8 @@
 #include "log.h"
 #include "scheduler.h"
+#include <assert.h>
+#include <unistd.h>
+#include <vector>
 
 using namespace qf;
 
@@ -14,12 +17,398 @@ void test_func(int j) {
 	}
 }
 
+static co::Local<int> taskTag;
+static std::atomic<int> inherited{0};
+
+void tagged_func() {
+	if (taskTag.Get() && *taskTag == 7) {
+		inherited++;
+	}
+}
+
+static std::atomic<int> live{0};
+
+struct Counted {
+	Counted() {
+		live++;
+	}
+
+	Counted(const Counted&) {
+		live++;
+	}
+
+	~Counted() {
+		live--;
+	}
+};
+
+static co::Local<Counted> counted;
+
+void test_local_inherit() {
+	*counted;
+	{
+		co::Scheduler sc(1);
+		for (int i = 0; i < 10; i++) {
+			sc.Schedule([]() {
+				assert(counted.Get());
+			});
+		}
+		//runs on the thread itself, the copy only for the call
+		sc.ScheduleInline([]() {
+			assert(counted.Get());
+			counted.Reset();
+		});
+		//worker 0 is this thread: its own value must not reach a task scheduled without one
+		sc.Schedule([&sc]() {
+			counted.Reset();
+			sc.Schedule([]() {
+				assert(!counted.Get());
+			});
+		});
+		sc.Run();
+	}
+	//no copy outlived its task, and this thread kept its own
+	assert(counted.Get() && live == 1);
+	counted.Reset();
+	assert(live == 0);
+}
+
+static std::atomic<int> cpuDone{0};
+static std::atomic<int> blockingDone{0};
+
+void blocking_func() {
+	int result = 0;
+	co::RunBlocking([&result]() {
+		usleep(50000);
+		result = 42;
+	});
+	assert(result == 42);
+	blockingDone++;
+}
+
+void test_blocking() {
+	//one worker: the sleeps must not hold it, the cpu tasks finish meanwhile
+	co::Scheduler sc(1);
+	sc.SetBlockingPool(8, 50);
+	uint64_t begin = util::NowNs();
+	for (int i = 0; i < 8; i++) {
+		sc.Schedule(&blocking_func);
+	}
+	for (int i = 0; i < 100; i++) {
+		sc.Schedule([]() {
+			cpuDone++;
+		});
+	}
+	sc.ScheduleBlocking([]() {
+		usleep(50000);
+		blockingDone++;
+	});
+	sc.Run();
+	uint64_t ms = (util::NowNs() - begin) / 1000000;
+	logger->Info("blocking jobs 9x50ms took(ms)", ms);
+	assert(cpuDone == 100);
+	assert(blockingDone == 9);
+
+	auto stats = sc.Stats();
+	assert(stats.blockingRun == 9);
+	assert(stats.blockingPeak > 1 && stats.blockingPeak <= 8);
+	//idle threads leave after 50ms
+	usleep(300000);
+	assert(sc.Stats().blockingThreads == 0);
+
+	//outside a coroutine it just runs
+	int x = 0;
+	co::RunBlocking([&x]() {
+		x = 1;
+	});
+	assert(x == 1);
+
+	//so it does in one the task resumes itself
+	co::Scheduler nested(1);
+	nested.Schedule([]() {
+		int y = 0;
+		auto child = co::Create([&y]() {
+			co::RunBlocking([&y]() {
+				y = 1;
+			});
+		});
+		co::Resume(child);
+		assert(y == 1);
+	});
+	nested.Run();
+}
+
+void test_blocking_locals() {
+	//a single pool thread runs the jobs one after the other
+	co::Scheduler sc(1);
+	sc.SetBlockingPool(1, 1000);
+	sc.Schedule([]() {
+		taskTag.Set(1);
+		co::RunBlocking([]() {
+			assert(*taskTag.Get() == 1);
+		});
+	});
+	sc.Schedule([]() {
+		co::RunBlocking([]() {
+			assert(!taskTag.Get());
+		});
+	});
+	*counted;
+	sc.ScheduleBlocking([]() {
+		assert(counted.Get());
+	});
+	counted.Reset();
+	sc.ScheduleBlocking([]() {
+		assert(!counted.Get());
+	});
+	sc.Run();
+	assert(sc.Stats().blockingThreads == 1 && live == 0);
+}
+
+void test_stall() {
+	//a task suspended with nobody to resume it: Run gives up on it instead of hanging
+	co::Scheduler sc(2);
+	sc.SetStallTimeout(50);
+	std::atomic<int> done{0};
+	sc.Schedule([]() {
+		co::Yield();
+		assert(false);
+	});
+	for (int i = 0; i < 10; i++) {
+		sc.Schedule([&done]() {
+			done++;
+		});
+	}
+	sc.Run();
+	assert(done == 10);
+}
+
+static std::atomic<bool> longDone{false};
+static std::atomic<int> shortBeforeLong{0};
+
+void long_func() {
+	uint64_t end = util::NowNs() + 100000000;
+	while (util::NowNs() < end) {
+		co::MaybeYield();
+	}
+	longDone = true;
+}
+
+void test_preempt() {
+	co::Scheduler sc(1);
+	sc.SetTimeSlice(1000, 20);
+	sc.Schedule(&long_func);
+	for (int i = 0; i < 10; i++) {
+		sc.Schedule([]() {
+			if (!longDone) {
+				shortBeforeLong++;
+			}
+		});
+	}
+	sc.Run();
+	auto stats = sc.Stats();
+	logger->Info("preempted", stats.workers[0].preempted, "long", stats.workers[0].longTasks);
+	//the short ones got the worker in the first slice the long one gave up
+	assert(shortBeforeLong == 10);
+	assert(stats.workers[0].preempted > 0);
+	assert(stats.workers[0].longTasks == 0);
+
+	//a coroutine the task resumes itself is not requeued, it runs to its end in the Resume
+	co::Scheduler nested(1);
+	nested.SetTimeSlice(1000);
+	nested.Schedule([]() {
+		bool done = false;
+		auto child = co::Create([&done]() {
+			long_func();
+			done = true;
+		});
+		co::Resume(child);
+		assert(done);
+	});
+	nested.Run();
+
+	//one that never checks is only reported
+	co::Scheduler stuck(1);
+	stuck.SetTimeSlice(1000, 20);
+	stuck.Schedule([]() {
+		uint64_t end = util::NowNs() + 100000000;
+		while (util::NowNs() < end) {
+
+		}
+	});
+	stuck.Run();
+	assert(stuck.Stats().workers[0].longTasks == 1);
+}
+
+static std::atomic<int> admitted{0};
+static std::atomic<int> background{0};
+
+void admitted_func() {
+	admitted++;
+}
+
+void test_capacity() {
+	{
+		co::Scheduler sc(1);
+		sc.SetCapacity(10, 0, co::Overflow::REJECT);
+		int accepted = 0;
+		for (int i = 0; i < 20; i++) {
+			accepted += sc.Schedule(&admitted_func);
+		}
+		assert(accepted == 10);
+		sc.Run();
+		assert(admitted == 10);
+		assert(sc.Stats().rejected == 10);
+	}
+	{
+		//the oldest goes first, also without the enqueue timestamps of the stats
+		co::Scheduler sc(1);
+		sc.EnableStats(false);
+		sc.SetCapacity(3, 0, co::Overflow::SHED_OLDEST);
+		std::vector<int> order;
+		for (int i = 0; i < 3; i++) {
+			sc.ScheduleBackground([&order, i]() {
+				order.push_back(i);
+			});
+		}
+		bool accepted = sc.Schedule([&order]() {
+			order.push_back(-1);
+		});
+		assert(accepted);
+		sc.Run();
+		assert(sc.Stats().shed == 1 && order == std::vector<int>({ 1, 2, -1 }));
+	}
+	{
+		//before Run nothing could make room, BLOCK rejects
+		co::Scheduler sc(1);
+		sc.SetCapacity(2);
+		bool first = sc.Schedule(&admitted_func);
+		bool second = sc.TrySchedule(&admitted_func);
+		bool tried = sc.TrySchedule(&admitted_func);
+		bool blocked = sc.Schedule(&admitted_func);
+		assert(first && second && !tried && !blocked);
+		sc.Run();
+	}
+	{
+		//per worker: its own queue fills, the others do not
+		co::Scheduler sc(2);
+		sc.SetCapacity(0, 2, co::Overflow::REJECT);
+		int own = sc.TSchedule(0, &admitted_func) + sc.TSchedule(0, &admitted_func);
+		bool full = !sc.TSchedule(0, &admitted_func);
+		int others = sc.TSchedule(1, &admitted_func) + sc.Schedule(&admitted_func);
+		assert(own == 2 && full && others == 2);
+		sc.Run();
+		assert(sc.Stats().workers[0].queueHighWater == 2);
+	}
+	{
+		co::Scheduler sc(1);
+		sc.SetCapacity(5, 0, co::Overflow::SHED_OLDEST);
+		for (int i = 0; i < 5; i++) {
+			sc.ScheduleBackground([]() {
+				background++;
+			});
+		}
+		int accepted = 0;
+		for (int i = 0; i < 6; i++) {
+			accepted += sc.Schedule(&admitted_func);
+		}
+		//five background tasks made room for five, the sixth finds none to shed
+		assert(accepted == 5);
+		admitted = 0;
+		sc.Run();
+		assert(background == 0 && admitted == 5);
+		assert(sc.Stats().shed == 5 && sc.Stats().rejected == 1);
+	}
+	{
+		//a coroutine producer suspends while the queue is full, its worker drains it
+		co::Scheduler sc(2);
+		sc.SetCapacity(4);
+		admitted = 0;
+		sc.Schedule([&sc]() {
+			for (int i = 0; i < 1000; i++) {
+				bool accepted = sc.Schedule(&admitted_func);
+				assert(accepted);
+			}
+		});
+		sc.Run();
+		auto stats = sc.Stats();
+		logger->Info("coroutine producer blocked", stats.blocked, "highwater", stats.queueHighWater);
+		assert(admitted == 1000);
+		assert(stats.blocked > 0);
+		//the fresh tasks stay within 4, resumed producers may come on top
+		assert(stats.queueHighWater <= 6);
+	}
+	{
+		//a nested coroutine on a worker is admitted over capacity, it cannot be suspended
+		co::Scheduler sc(1);
+		sc.SetCapacity(4);
+		admitted = 0;
+		sc.Schedule([&sc]() {
+			auto child = co::Create([&sc]() {
+				for (int i = 0; i < 10; i++) {
+					bool accepted = sc.Schedule(&admitted_func);
+					assert(accepted);
+				}
+			});
+			co::Resume(child);
+			assert(child->status == co::CoStatus::DEAD);
+		});
+		sc.Run();
+		assert(admitted == 10 && sc.Stats().blocked == 0);
+	}
+	{
+		//a thread producer waits on the condvar
+		co::Scheduler sc(1);
+		sc.SetCapacity(4);
+		admitted = 0;
+		sc.Schedule([&sc]() {
+			auto producer = thread::CreateThread([&sc]() {
+				for (int i = 0; i < 1000; i++) {
+					bool accepted = sc.Schedule(&admitted_func);
+					assert(accepted);
+				}
+			});
+			producer->Run();
+			co::RunBlocking([producer]() {
+				producer->Join();
+			});
+		});
+		sc.Run();
+		assert(admitted == 1000);
+		assert(sc.Stats().queueHighWater <= 6);
+	}
+}
+
 int main(int argc, char* argv[]) {
+	test_local_inherit();
+	test_capacity();
+	test_blocking();
+	test_blocking_locals();
+	test_stall();
+	test_preempt();
+
 	int a = 12345;
+	taskTag.Set(7);
+	for (int i = 0; i < 10; i++) {
+		co::Scheduler tsc;
+		tsc.Schedule(&tagged_func);
+		tsc.Run();
+	}
+	assert(inherited == 10);
+	taskTag.Reset();
+
 	co::Scheduler sc;
+	sc.SetStatsDump(1000);
 	sc.TSchedule(1, &test_func, a);
 	sc.TSchedule(1, &test_func, a);
 	sc.Run();
 	logger->Info("Result", n);
+
+	auto stats = sc.Stats();
+	assert(stats.scheduled == 2);
+	assert(stats.queueDepth == 0);
+	assert(stats.workers[1].executed == 2);
+	assert(stats.workers[1].pinned == 2);
+	assert(stats.runNs.Count() == 2);
 	return 0;
 }
@@ -0,0 +1,96 @@
+#include "coroutine.h"
+#include "log.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace qf;
+
+static auto logger = GetLogger();
+
+static int finished = 0;
+
+//keeps a buffer alive across yields to check it survives the copy out and back in
+void idle(int seed) {
+	char buf[512];
+	memset(buf, seed & 0xff, sizeof(buf));
+	co::Yield();
+	for (size_t i = 0; i < sizeof(buf); i++) {
+		assert(buf[i] == (char)(seed & 0xff));
+	}
+	co::Yield();
+	finished++;
+}
+
+void test_nested() {
+	//resumes a coroutine on the very stack it runs on, which then dies
+	auto outer = co::CreateShared([]() {
+		int mark = 42;
+		auto inner = co::CreateShared(&idle, 7);
+		co::Resume(inner);
+		assert(mark == 42);
+		co::Yield();
+		co::Resume(inner);
+		co::Resume(inner);
+		assert(mark == 42);
+		assert(co::Status(inner) == std::string("Dead"));
+	});
+	co::Resume(outer);
+	auto other = co::CreateShared(&idle, 9);
+	co::Resume(other);
+	co::Resume(outer);
+	co::Resume(other);
+	co::Resume(other);
+	assert(finished == 2);
+}
+
+static long rss_kb() {
+	long pages = 0, resident = 0;
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if (fp) {
+		if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(fp);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void bench(co::StackMode mode, int n) {
+	finished = 0;
+	long before = rss_kb();
+	std::vector<co::CoroutinePtr> cos;
+	cos.reserve(n);
+	for (int i = 0; i < n; i++) {
+		auto co = mode == co::StackMode::SHARED ? co::CreateShared(&idle, i) : co::Create(&idle, i);
+		co::Resume(co);
+		cos.push_back(co);
+	}
+	long idleKb = rss_kb() - before;
+
+	uint64_t begin = util::NowNs();
+	for (auto& co : cos) {
+		co::Resume(co);
+	}
+	uint64_t switchNs = (util::NowNs() - begin) / n;
+	for (auto& co : cos) {
+		co::Resume(co);
+	}
+	assert(finished == n);
+	logger->Info(mode == co::StackMode::SHARED ? "shared" : "private", "idle coroutines", n,
+			"rss(KB)", idleKb, "bytes/co", idleKb * 1024 / n, "resume+yield(ns)", switchNs);
+}
+
+int main(int argc, char* argv[]) {
+	co::GetManager()->SetSharedStacks(1, 1024 * 1024);
+	test_nested();
+
+	//try 1000000: private stacks are capped by vm.max_map_count, one mapping each
+	int n = argc > 1 ? atoi(argv[1]) : 100000;
+	bench(co::StackMode::SHARED, n);
+	bench(co::StackMode::PRIVATE, n < 20000 ? n : 20000);
+	return 0;
+}
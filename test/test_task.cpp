@@ -0,0 +1,104 @@
+#include "log.h"
+#include "scheduler.h"
+#include "task.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace qf;
+
+static auto logger = GetLogger();
+
+static std::atomic<int> finished{0};
+static std::atomic<long> total{0};
+
+co::Task<int> twice(int x) {
+	co_return x * 2;
+}
+
+co::Task<int> sum(int n) {
+	int s = 0;
+	for (int i = 0; i < n; i++) {
+		s += co_await twice(i);
+	}
+	co_await co::Reschedule();
+	co_return s;
+}
+
+co::Task<void> root() {
+	int s = co_await sum(10);
+	assert(s == 90);
+	//stackless awaiting stackful
+	int y = co_await co::Stackful([]() {
+		return co::Running() ? 7 : 0;
+	});
+	assert(y == 7);
+	co_await co::Stackful([]() {
+		//stackful awaiting stackless
+		int v = co::Await(sum(4));
+		assert(v == 12);
+	});
+	finished++;
+}
+
+co::Task<void> fan_out(int i) {
+	co_await co::Reschedule();
+	total += co_await twice(i);
+}
+
+static long rss_kb() {
+	long pages = 0, resident = 0;
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if (fp) {
+		if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(fp);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int main(int argc, char* argv[]) {
+	{
+		co::Scheduler sc;
+		for (int i = 0; i < 100; i++) {
+			co::Spawn(sc, root());
+		}
+		sc.Run();
+		assert(finished == 100);
+	}
+	{
+		//outside a task: on a plain thread it runs right here
+		int v = co::Await(twice(21));
+		assert(v == 42);
+		//in a coroutine the task resumes itself, the worker waits while the other one reschedules it
+		co::Scheduler sc(2);
+		sc.Schedule([]() {
+			int w = 0;
+			auto child = co::Create([&w]() {
+				w = co::Await(sum(4));
+			});
+			co::Resume(child);
+			assert(child->status == co::CoStatus::DEAD && w == 12);
+			finished++;
+		});
+		sc.Run();
+		assert(finished == 101);
+	}
+
+	int n = argc > 1 ? atoi(argv[1]) : 200000;
+	long before = rss_kb();
+	co::Scheduler sc;
+	long expected = 0;
+	for (int i = 0; i < n; i++) {
+		co::Spawn(sc, fan_out(i));
+		expected += i * 2;
+	}
+	long queued = rss_kb();
+	uint64_t begin = util::NowNs();
+	sc.Run();
+	assert(total == expected);
+	logger->Info("stackless tasks", n, "in flight rss(KB)", queued - before,
+			"ns/task", (util::NowNs() - begin) / n);
+	return 0;
+}
@@ -1,5 +1,7 @@
+#include "cow.h"
 #include "thread.h"
 #include "log.h"
+#include <assert.h>
 #include <vector>
 #include <tuple>
 #include <unistd.h>
@@ -24,7 +26,60 @@ void test_tuple() {
 	logger->Info("value 2", std::get<0>(tp));
 }
 
+static std::atomic<int> alive{0};
+
+struct Snapshot {
+	Snapshot() {
+		alive++;
+	}
+
+	Snapshot(const Snapshot& other)
+		: values(other.values) {
+		alive++;
+	}
+
+	~Snapshot() {
+		alive--;
+	}
+
+	std::vector<int> values;
+};
+
+static thread::CowPtr<Snapshot> cow;
+static std::atomic<bool> stop{false};
+
+void cow_reader() {
+	while (!stop.load()) {
+		thread::CowPtr<Snapshot>::Reader snap(cow);
+		//a writer only ever appends i after i-1
+		for (size_t i = 0; i < snap->values.size(); i++) {
+			assert(snap->values[i] == (int)i);
+		}
+	}
+}
+
+void test_cow() {
+	std::vector<thread::ThreadPtr> readers;
+	for (int i = 0; i < 3; i++) {
+		readers.push_back(thread::CreateThread(cow_reader));
+		readers.back()->Run();
+	}
+	for (int i = 0; i < 2000; i++) {
+		cow.Update([i](Snapshot& snap) {
+			snap.values.push_back(i);
+		});
+	}
+	stop = true;
+	for (auto& thd : readers) {
+		thd->Join();
+	}
+	thread::Epoch::Reclaim();
+	//every replaced snapshot is gone, only the current one is left
+	assert(alive == 1);
+}
+
 int main(int argc, char* argv[]) {
+	test_cow();
 	std::vector<thread::ThreadPtr> vec;
 	for (int i = 0; i < 3; i++) {
 		auto thread = thread::CreateThread(thread_entry, i);
@@ -0,0 +1,79 @@
+#include "log.h"
+#include "scheduler.h"
+#include "thread.h"
+#include "trace.h"
+#include <assert.h>
+#include <fstream>
+#include <sstream>
+
+using namespace qf;
+
+static auto logger = GetLogger();
+
+void yield_twice(int i) {
+	auto co = co::Create([]() {
+		co::Yield();
+		co::Yield();
+	});
+	co::Resume(co);
+	co::Resume(co);
+	co::Resume(co);
+}
+
+void record_once(int arg) {
+	trace::Record(trace::EventType::PARK, arg);
+}
+
+int main(int argc, char* argv[]) {
+	trace::Start();
+	co::Scheduler sc;
+	for (int i = 0; i < 10; i++) {
+		sc.Schedule(&yield_twice, i);
+	}
+	sc.Run();
+	trace::Stop();
+
+	bool flushed = trace::Flush("trace.json");
+	assert(flushed);
+	std::ifstream ifs("trace.json");
+	std::stringstream ss;
+	ss << ifs.rdbuf();
+	assert(ss.str().find("\"ph\":\"B\"") != std::string::npos);
+	assert(ss.str().find("\"dequeue\"") != std::string::npos);
+	assert(ss.str().find("\"yield\"") != std::string::npos);
+	logger->Info("trace.json bytes", ss.str().size());
+
+	//a thread's buffer outlives it until flushed, then the next thread takes it over
+	trace::Start();
+	size_t buffers = trace::BufferNum();
+	for (int i = 0; i < 4; i++) {
+		auto thd = thread::CreateThread(&record_once, 100 + i);
+		thd->Run();
+		thd->Join();
+		flushed = trace::Flush("trace.json");
+		assert(flushed);
+	}
+	assert(trace::BufferNum() <= buffers + 1);
+	for (int i = 0; i < 4; i++) {
+		auto thd = thread::CreateThread(&record_once, 200 + i);
+		thd->Run();
+		thd->Join();
+	}
+	trace::Stop();
+	flushed = trace::Flush("trace.json");
+	assert(flushed);
+	std::ifstream exited("trace.json");
+	std::stringstream es;
+	es << exited.rdbuf();
+	for (int i = 0; i < 4; i++) {
+		assert(es.str().find("\"arg\":" + std::to_string(200 + i) + "}") != std::string::npos);
+	}
+
+	//only once flushed: the ring keeps the newest events, these would push out the ones checked above
+	uint64_t begin = util::NowNs();
+	for (int i = 0; i < 1000000; i++) {
+		trace::Record(trace::EventType::UNPARK, i);
+	}
+	logger->Info("record cost(ns)", (util::NowNs() - begin) / 1000000.0);
+	return 0;
+}